@@ -0,0 +1,185 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AcqStats.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free acquisition counters, rolling latency percentiles
+//                and the periodic statistics snapshot writer
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "AcqStats.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Timing
+///////////////////////////////////////////////////////////////////////////////
+
+LONGLONG StatsNow()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+double StatsTicksToMs(LONGLONG ticks)
+{
+    static double msPerTick = 0.0;
+    if (msPerTick == 0.0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        msPerTick = 1000.0 / frequency.QuadPart;
+    }
+    return ticks * msPerTick;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencyWindow
+///////////////////////////////////////////////////////////////////////////////
+
+LatencyWindow::LatencyWindow()
+{
+    Reset();
+}
+
+void LatencyWindow::Reset()
+{
+    memset(samples_, 0, sizeof(samples_));
+    count_ = 0;
+}
+
+void LatencyWindow::Add(LONGLONG ticks)
+{
+    samples_[count_ & (STATS_LATENCY_SAMPLES - 1)] = ticks;
+    /* Publish the sample before the count that makes it visible */
+    InterlockedIncrement(&count_);
+}
+
+double LatencyWindow::PercentileMs(double percentile) const
+{
+    LONG count = count_;
+    if (count <= 0)
+        return 0.0;
+    if (count > STATS_LATENCY_SAMPLES)
+        count = STATS_LATENCY_SAMPLES;
+
+    /* Samples may be overwritten while copying, that only shifts the window by a few entries */
+    std::vector<LONGLONG> sorted(samples_, samples_ + count);
+    size_t rank = (size_t)(percentile / 100.0 * (count - 1) + 0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return StatsTicksToMs(sorted[rank]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AcqStats
+///////////////////////////////////////////////////////////////////////////////
+
+AcqStats::AcqStats()
+{
+    Reset();
+}
+
+void AcqStats::Reset()
+{
+    for (int i = 0; i < eacCounterCount; i++)
+        counters_[i].value = 0;
+    for (int i = 0; i < ealLatencyCount; i++)
+        latencies_[i].Reset();
+}
+
+std::string AcqStats::FormatSnapshot() const
+{
+    std::ostringstream os;
+    os << "FramesReceived=" << Get(eacReceived) << "\n";
+    os << "FramesGrabbed=" << Get(eacGrabbed) << "\n";
+    os << "FramesInserted=" << Get(eacInserted) << "\n";
+    os << "FramesDropped=" << Get(eacDropped) << "\n";
+    os << "Timeouts=" << Get(eacTimeouts) << "\n";
+    os << "EventsLost=" << Get(eacEventsLost) << "\n";
+    os << "GrabLatencyP50Ms=" << GetLatencyMs(ealGrab, 50.0) << "\n";
+    os << "GrabLatencyP99Ms=" << GetLatencyMs(ealGrab, 99.0) << "\n";
+    os << "InsertLatencyP50Ms=" << GetLatencyMs(ealInsert, 50.0) << "\n";
+    os << "InsertLatencyP99Ms=" << GetLatencyMs(ealInsert, 99.0) << "\n";
+    os << "WakeupLatencyP50Ms=" << GetLatencyMs(ealWakeup, 50.0) << "\n";
+    os << "WakeupLatencyP99Ms=" << GetLatencyMs(ealWakeup, 99.0) << "\n";
+    return os.str();
+}
+
+bool AcqStats::WriteSnapshot(const std::string& path) const
+{
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!file)
+        return false;
+    file << FormatSnapshot();
+    return file.good();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StatsMonitorThread
+///////////////////////////////////////////////////////////////////////////////
+
+StatsMonitorThread::StatsMonitorThread(const AcqStats* stats) :
+    stats_(stats),
+    intervalMs_(1000),
+    quit_(false),
+    running_(false)
+{
+}
+
+StatsMonitorThread::~StatsMonitorThread()
+{
+    Stop();
+}
+
+void StatsMonitorThread::Start(const std::string& path, long intervalMs)
+{
+    Stop();
+    path_ = path;
+    intervalMs_ = intervalMs;
+    quit_ = false;
+    running_ = true;
+    activate();
+}
+
+void StatsMonitorThread::Stop()
+{
+    if (!running_)
+        return;
+
+    quit_ = true;
+    wakeEvent_.Set();
+    wait();
+    running_ = false;
+}
+
+int StatsMonitorThread::svc(void) throw()
+{
+    while (!quit_)
+    {
+        wakeEvent_.Wait(intervalMs_);
+        try
+        {
+            stats_->WriteSnapshot(path_);
+        }
+        catch (...)
+        {
+        }
+    }
+    return 0;
+}
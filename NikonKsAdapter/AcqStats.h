@@ -0,0 +1,132 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AcqStats.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free acquisition counters, rolling latency percentiles
+//                and the periodic statistics snapshot writer
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_ACQSTATS_H_
+#define _NIKONKS_ACQSTATS_H_
+
+#ifdef WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#endif
+#include "../../../MMDevice/DeviceThreads.h"
+#include "DeviceEvents.h"
+
+#include <string>
+
+/* Window of the rolling latency percentiles, must be a power of two */
+#define STATS_LATENCY_SAMPLES	1024
+#define STATS_CACHE_LINE		64
+
+enum EAcqCounter
+{
+	eacReceived		= 0,	// ecetImageReceived callbacks
+	eacGrabbed		= 1,	// frames taken from the driver
+	eacInserted		= 2,	// frames inserted into the MMCore buffer
+	eacDropped		= 3,	// gaps in the footer frame numbers
+	eacTimeouts		= 4,	// waits for a frame that timed out
+	eacEventsLost	= 5,	// callback events dropped because the event ring was full
+	eacCounterCount	= 6,
+};
+
+enum EAcqLatency
+{
+	ealGrab			= 0,	// ecetImageReceived callback -> CAM_GetImage returned
+	ealInsert		= 1,	// ecetImageReceived callback -> InsertImage returned
+	ealWakeup		= 2,	// frameDoneEvent_ set in the callback -> grab stage woke up
+	ealLatencyCount	= 3,
+};
+
+/* QueryPerformanceCounter ticks */
+LONGLONG StatsNow();
+double StatsTicksToMs(LONGLONG ticks);
+
+/* The last STATS_LATENCY_SAMPLES latencies. Add() must only be called from one thread,
+   readers copy the window so the writer never waits on them. */
+class LatencyWindow
+{
+public:
+	LatencyWindow();
+
+	void Reset();
+	void Add(LONGLONG ticks);
+	/* percentile in 0..100, 0 when there are no samples yet */
+	double PercentileMs(double percentile) const;
+
+private:
+	LONGLONG samples_[STATS_LATENCY_SAMPLES];
+	volatile LONG count_;
+};
+
+/* Acquisition counters and latencies for one sequence. Every update is a single
+   interlocked operation on its own cache line, nothing takes a lock. */
+class AcqStats
+{
+public:
+	AcqStats();
+
+	void Reset();
+
+	void Increment(EAcqCounter counter) {InterlockedIncrement(&counters_[counter].value);}
+	void Add(EAcqCounter counter, LONG n) {InterlockedExchangeAdd(&counters_[counter].value, n);}
+	long Get(EAcqCounter counter) const {return counters_[counter].value;}
+
+	void AddLatency(EAcqLatency latency, LONGLONG ticks) {latencies_[latency].Add(ticks);}
+	double GetLatencyMs(EAcqLatency latency, double percentile) const {return latencies_[latency].PercentileMs(percentile);}
+
+	/* key=value lines, one per counter and percentile */
+	std::string FormatSnapshot() const;
+	bool WriteSnapshot(const std::string& path) const;
+
+private:
+	struct PaddedCounter
+	{
+		volatile LONG value;
+		char pad[STATS_CACHE_LINE - sizeof(LONG)];
+	};
+
+	PaddedCounter counters_[eacCounterCount];
+	LatencyWindow latencies_[ealLatencyCount];
+};
+
+/* Rewrites the snapshot file every interval until stopped */
+class StatsMonitorThread : public MMDeviceThreadBase
+{
+public:
+	StatsMonitorThread(const AcqStats* stats);
+	~StatsMonitorThread();
+
+	/* Restarts the thread if it is already running */
+	void Start(const std::string& path, long intervalMs);
+	void Stop();
+	bool IsRunning() const {return running_;}
+
+private:
+	int svc(void) throw();
+
+	const AcqStats* stats_;
+	std::string path_;
+	long intervalMs_;
+	volatile bool quit_;
+	bool running_;
+	MMEvent wakeEvent_;
+};
+
+#endif //_NIKONKS_ACQSTATS_H_
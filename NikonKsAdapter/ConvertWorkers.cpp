@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ConvertWorkers.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Persistent worker pool that runs frame conversion jobs
+//                in parallel row stripes
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "ConvertWorkers.h"
+#include <cstring>
+
+///////////////////////////////////////////////////////////////////////////////
+// FrameConvertJob
+///////////////////////////////////////////////////////////////////////////////
+
+void FrameConvertJob::Run(unsigned rowBegin, unsigned rowEnd, std::vector<unsigned char>&)
+{
+    if (contiguous)
+    {
+        convert(dest + rowBegin * destRowBytes, src + rowBegin * srcRowBytes, (size_t)(rowEnd - rowBegin) * width);
+        return;
+    }
+
+    for (unsigned row = rowBegin; row < rowEnd; row++)
+    {
+        convert(dest + row * destRowBytes, src + row * srcRowBytes, width);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FrameBinJob
+///////////////////////////////////////////////////////////////////////////////
+
+void FrameBinJob::Run(unsigned rowBegin, unsigned rowEnd, std::vector<unsigned char>& scratch)
+{
+    if (convert == NULL)
+    {
+        for (unsigned row = rowBegin; row < rowEnd; row++)
+            bin(dest + row * destRowBytes, src + (size_t)row * factor * srcRowBytes, srcRowBytes, width, factor, mean);
+        return;
+    }
+
+    size_t scratchRowBytes = (size_t)width * factor * bytesPerPixel;
+    /* Only grows, after the first frame of a size this never allocates */
+    if (scratch.size() < scratchRowBytes * factor)
+        scratch.resize(scratchRowBytes * factor);
+    for (unsigned row = rowBegin; row < rowEnd; row++)
+    {
+        for (unsigned r = 0; r < factor; r++)
+            convert(&scratch[r * scratchRowBytes], src + ((size_t)row * factor + r) * srcRowBytes, (size_t)width * factor);
+        bin(dest + row * destRowBytes, &scratch[0], scratchRowBytes, width, factor, mean);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StripeWorkerPool
+///////////////////////////////////////////////////////////////////////////////
+
+StripeWorkerPool::StripeWorkerPool() :
+    threadCount_(1),
+    pending_(0)
+{
+}
+
+StripeWorkerPool::~StripeWorkerPool()
+{
+    StopWorkers();
+}
+
+void StripeWorkerPool::SetThreadCount(unsigned count)
+{
+    if (count < 1)
+        count = 1;
+    if (count > CONVERT_THREADS_MAX)
+        count = CONVERT_THREADS_MAX;
+
+    MMThreadGuard g(executeLock_);
+    if (count == threadCount_)
+        return;
+
+    StopWorkers();
+    /* The calling thread always converts the first stripe, so only count - 1 workers are needed */
+    for (unsigned i = 1; i < count; i++)
+    {
+        auto worker = new StripeWorkerThread(this);
+        worker->activate();
+        workers_.push_back(worker);
+    }
+    threadCount_ = count;
+}
+
+void StripeWorkerPool::StopWorkers()
+{
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        workers_[i]->quit_ = true;
+        workers_[i]->startEvent_.Set();
+        workers_[i]->wait();
+        delete workers_[i];
+    }
+    workers_.clear();
+    threadCount_ = 1;
+}
+
+void StripeWorkerPool::StripeDone()
+{
+    if (InterlockedDecrement(&pending_) == 0)
+        doneEvent_.Set();
+}
+
+void StripeWorkerPool::Execute(StripeJob& job, unsigned rows, size_t destRowBytes)
+{
+    MMThreadGuard g(executeLock_);
+
+    /* Small frames are not worth waking anybody up for */
+    size_t totalBytes = destRowBytes * rows;
+    size_t stripes = totalBytes / CONVERT_MIN_STRIPE_BYTES;
+    if (stripes > threadCount_)
+        stripes = threadCount_;
+    if (stripes <= 1)
+    {
+        job.Run(0, rows, scratch_);
+        return;
+    }
+
+    /* Stripes split on whole rows. MMCore's image buffer has no particular alignment, so two
+       neighbouring stripes can share the cache line their boundary falls in, one line per
+       boundary against a stripe of at least CONVERT_MIN_STRIPE_BYTES. */
+    unsigned bounds[CONVERT_THREADS_MAX + 1];
+    for (unsigned i = 0; i <= stripes; i++)
+        bounds[i] = (unsigned)((size_t)rows * i / stripes);
+
+    pending_ = (long)(stripes - 1);
+    for (unsigned i = 1; i < stripes; i++)
+    {
+        auto worker = workers_[i - 1];
+        worker->job_ = &job;
+        worker->rowBegin_ = bounds[i];
+        worker->rowEnd_ = bounds[i + 1];
+        worker->startEvent_.Set();
+    }
+
+    job.Run(bounds[0], bounds[1], scratch_);
+
+    doneEvent_.Wait();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StripeWorkerThread
+///////////////////////////////////////////////////////////////////////////////
+
+StripeWorkerThread::StripeWorkerThread(StripeWorkerPool* pool) :
+    pool_(pool),
+    job_(NULL),
+    rowBegin_(0),
+    rowEnd_(0),
+    quit_(false)
+{
+}
+
+StripeWorkerThread::~StripeWorkerThread()
+{
+}
+
+int StripeWorkerThread::svc(void) throw()
+{
+    for (;;)
+    {
+        startEvent_.Wait();
+        if (quit_)
+            break;
+
+        try
+        {
+            job_->Run(rowBegin_, rowEnd_, scratch_);
+        }
+        catch (...)
+        {
+        }
+        pool_->StripeDone();
+    }
+    return 0;
+}
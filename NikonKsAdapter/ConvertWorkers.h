@@ -0,0 +1,134 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ConvertWorkers.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Persistent worker pool that runs frame conversion jobs
+//                in parallel row stripes
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_CONVERTWORKERS_H_
+#define _NIKONKS_CONVERTWORKERS_H_
+
+#include "../../../MMDevice/DeviceThreads.h"
+#include "DeviceEvents.h"
+#include "ImageConvert.h"
+
+#include <vector>
+
+#define CONVERT_THREADS_MAX			16
+/* Frames smaller than this (per stripe) are converted on the calling thread */
+#define CONVERT_MIN_STRIPE_BYTES	(1024 * 1024)
+
+/* A piece of work that can be split into independent row ranges. scratch belongs to the thread
+   running the stripe and keeps its size between frames, so a job can use it without allocating. */
+class StripeJob
+{
+public:
+	virtual ~StripeJob() {}
+	virtual void Run(unsigned rowBegin, unsigned rowEnd, std::vector<unsigned char>& scratch) = 0;
+};
+
+/* Converts a whole frame row by row with one of the ImageConvert kernels */
+class FrameConvertJob : public StripeJob
+{
+public:
+	FrameConvertJob() :
+		dest(NULL), src(NULL), destRowBytes(0), srcRowBytes(0), width(0), contiguous(false), convert(NULL) {}
+
+	void Run(unsigned rowBegin, unsigned rowEnd, std::vector<unsigned char>& scratch);
+
+	unsigned char* dest;
+	const unsigned char* src;
+	size_t destRowBytes;
+	size_t srcRowBytes;
+	unsigned width;
+	bool contiguous;		// rows are packed back to back in both buffers
+	ConvertFunc convert;
+};
+
+/* Bins factor x factor driver pixels into one while copying them out, rows are output rows.
+   Color frames are converted a few source rows at a time into scratch rows that stay in cache. */
+class FrameBinJob : public StripeJob
+{
+public:
+	FrameBinJob() :
+		dest(NULL), src(NULL), destRowBytes(0), srcRowBytes(0), width(0), factor(1), bytesPerPixel(4), mean(true), convert(NULL), bin(NULL) {}
+
+	void Run(unsigned rowBegin, unsigned rowEnd, std::vector<unsigned char>& scratch);
+
+	unsigned char* dest;
+	const unsigned char* src;
+	size_t destRowBytes;
+	size_t srcRowBytes;
+	unsigned width;			// output pixels per row
+	unsigned factor;
+	unsigned bytesPerPixel;	// of the converted pixels
+	bool mean;				// average instead of a saturating sum
+	ConvertFunc convert;	// driver -> MMCore pixels before binning, NULL to bin the driver pixels directly
+	BinFunc bin;
+};
+
+class StripeWorkerThread;
+
+class StripeWorkerPool
+{
+	friend class StripeWorkerThread;
+
+public:
+	StripeWorkerPool();
+	~StripeWorkerPool();
+
+	/* Total number of threads taking part in a conversion, including the caller */
+	void SetThreadCount(unsigned count);
+	unsigned GetThreadCount() const {return threadCount_;}
+
+	/* Runs job over rows [0, rows). Blocks until every stripe has finished.
+	   destRowBytes * rows decides how many threads the frame is worth. */
+	void Execute(StripeJob& job, unsigned rows, size_t destRowBytes);
+
+private:
+	void StopWorkers();
+	void StripeDone();
+
+	unsigned threadCount_;
+	std::vector<StripeWorkerThread*> workers_;
+	volatile long pending_;
+	MMEvent doneEvent_;
+	MMThreadLock executeLock_;
+	std::vector<unsigned char> scratch_;	// for the stripe Execute() runs on the calling thread
+};
+
+class StripeWorkerThread : public MMDeviceThreadBase
+{
+	friend class StripeWorkerPool;
+
+public:
+	StripeWorkerThread(StripeWorkerPool* pool);
+	~StripeWorkerThread();
+
+private:
+	int svc(void) throw();
+
+	StripeWorkerPool* pool_;
+	StripeJob* job_;
+	unsigned rowBegin_;
+	unsigned rowEnd_;
+	bool quit_;
+	MMEvent startEvent_;
+	std::vector<unsigned char> scratch_;
+};
+
+#endif //_NIKONKS_CONVERTWORKERS_H_
@@ -0,0 +1,197 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DescCache.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Memory mapped on-disk cache of feature descriptors
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "DescCache.h"
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+/* "KSDC" */
+#define DESCCACHE_MAGIC		0x4344534B
+
+#define DESCCACHE_PAD(size)	(((size) + 7) & ~(size_t)7)
+
+/* Bytes of desc that carry information: the fixed fields plus the used part of the list */
+static size_t UsedSize(const CAM_FeatureDesc& desc)
+{
+    size_t count = (desc.uiListCount < CAM_FEA_DESK_LIST_MAX) ? desc.uiListCount : CAM_FEA_DESK_LIST_MAX;
+
+    switch (desc.eFeatureDescType)
+    {
+    case edesc_int32List:
+        return offsetof(CAM_FeatureDesc, i32List) + count * sizeof(desc.i32List[0]);
+    case edesc_doubleList:
+        return offsetof(CAM_FeatureDesc, dList) + count * sizeof(desc.dList[0]);
+    case edesc_ElementList:
+        return offsetof(CAM_FeatureDesc, stElementList) + count * sizeof(desc.stElementList[0]);
+    case edesc_FormatList:
+        return offsetof(CAM_FeatureDesc, stFormatList) + count * sizeof(desc.stFormatList[0]);
+    case edesc_Range:
+        return offsetof(CAM_FeatureDesc, stRange) + sizeof(desc.stRange);
+    case edesc_Area:
+        return offsetof(CAM_FeatureDesc, stArea) + sizeof(desc.stArea);
+    case edesc_Position:
+        return offsetof(CAM_FeatureDesc, stPosition) + sizeof(desc.stPosition);
+    case edesc_TriggerOption:
+        return offsetof(CAM_FeatureDesc, stTriggerOption) + sizeof(desc.stTriggerOption);
+    default:
+        return offsetof(CAM_FeatureDesc, i32List);
+    }
+}
+
+DescCache::DescCache() :
+    file_(INVALID_HANDLE_VALUE),
+    mapping_(NULL),
+    header_(NULL)
+{
+}
+
+DescCache::~DescCache()
+{
+    Close();
+}
+
+bool DescCache::Open(const std::string& path, const DescCacheKey& key)
+{
+    Close();
+
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file_, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(DescCacheHeader))
+    {
+        Close();
+        return false;
+    }
+
+    mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_ == NULL)
+    {
+        Close();
+        return false;
+    }
+    header_ = static_cast<const DescCacheHeader*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (header_ == NULL)
+    {
+        Close();
+        return false;
+    }
+
+    if (header_->uiMagic != DESCCACHE_MAGIC || header_->uiVersion != DESCCACHE_VERSION ||
+        header_->uiDescSize != sizeof(CAM_FeatureDesc) ||
+        memcmp(&header_->stKey, &key, sizeof(DescCacheKey)) != 0)
+    {
+        Close();
+        return false;
+    }
+
+    /* Index the records, anything running past the end of the file rejects the whole file */
+    for (lx_uint32 i = 0; i < KSCAM_FEATURE_ID_COUNT; i++)
+        record_[i] = NULL;
+    const unsigned char* begin = reinterpret_cast<const unsigned char*>(header_);
+    size_t offset = sizeof(DescCacheHeader);
+    for (lx_uint32 i = 0; i < header_->uiCount; i++)
+    {
+        const DescCacheRecord* record = reinterpret_cast<const DescCacheRecord*>(begin + offset);
+        if (offset + sizeof(DescCacheRecord) > (size_t)fileSize.QuadPart ||
+            record->uiSize > sizeof(CAM_FeatureDesc) ||
+            offset + sizeof(DescCacheRecord) + record->uiSize > (size_t)fileSize.QuadPart)
+        {
+            Close();
+            return false;
+        }
+        if (record->uiFeatureId < KSCAM_FEATURE_ID_COUNT)
+            record_[record->uiFeatureId] = record;
+        offset += sizeof(DescCacheRecord) + DESCCACHE_PAD(record->uiSize);
+    }
+    return true;
+}
+
+void DescCache::Close()
+{
+    if (header_ != NULL)
+        UnmapViewOfFile(header_);
+    if (mapping_ != NULL)
+        CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+    header_ = NULL;
+    mapping_ = NULL;
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+bool DescCache::Lookup(lx_uint32 featureId, CAM_FeatureDesc& desc) const
+{
+    if (header_ == NULL || featureId >= KSCAM_FEATURE_ID_COUNT || record_[featureId] == NULL)
+        return false;
+    memcpy(&desc, record_[featureId] + 1, record_[featureId]->uiSize);
+    return true;
+}
+
+bool DescCache::Write(const std::string& path, const DescCacheKey& key, const CAM_FeatureDesc* const* descs, lx_uint32 count)
+{
+    DescCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.uiMagic = DESCCACHE_MAGIC;
+    header.uiVersion = DESCCACHE_VERSION;
+    header.uiDescSize = sizeof(CAM_FeatureDesc);
+    header.uiCount = count;
+    header.stKey = key;
+
+    /* A half written file must never be mapped, so write elsewhere and swap it in */
+    std::string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (file == NULL)
+        return false;
+    static const unsigned char padding[8] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (lx_uint32 i = 0; ok && i < count; i++)
+    {
+        DescCacheRecord record;
+        record.uiFeatureId = descs[i]->uiFeatureId;
+        record.uiSize = (lx_uint32)UsedSize(*descs[i]);
+        size_t pad = DESCCACHE_PAD(record.uiSize) - record.uiSize;
+        ok = fwrite(&record, sizeof(record), 1, file) == 1 &&
+             fwrite(descs[i], record.uiSize, 1, file) == 1 &&
+             (pad == 0 || fwrite(padding, pad, 1, file) == 1);
+    }
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || !MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileA(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool DescCache::IsLive(lx_uint32 featureId)
+{
+    switch (featureId)
+    {
+    case eRoiPosition:
+    case eMeteringArea:
+    case eTriggerMode:
+        return true;
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,97 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DescCache.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Memory mapped on-disk cache of feature descriptors
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_DESCCACHE_H_
+#define _NIKONKS_DESCCACHE_H_
+
+#ifdef WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#endif
+
+#include <KsCam.h>
+#include <KsCamFeature.h>
+
+#include "FeatureRegistry.h"
+
+#include <string>
+
+/* Bump whenever the file layout changes */
+#define DESCCACHE_VERSION	1
+
+/* Everything a cached descriptor set depends on. Compared byte for byte, so zero it first. */
+struct DescCacheKey
+{
+	lx_uint32 uiSerialNo;
+	lx_wchar wszFwVersion[CAM_VERSION_MAX];
+	lx_wchar wszFpgaVersion[CAM_VERSION_MAX];
+	lx_wchar wszSdkVersion[CAM_VERSION_MAX];
+};
+
+/* File layout: DescCacheHeader followed by uiCount records. A record is a DescCacheRecord and the
+   first uiSize bytes of the CAM_FeatureDesc, padded to 8 bytes. CAM_FeatureDesc is over 500 KB
+   because of its fixed list arrays, so only the used part of the list is stored. */
+struct DescCacheHeader
+{
+	lx_uint32 uiMagic;
+	lx_uint32 uiVersion;
+	lx_uint32 uiDescSize;		// sizeof(CAM_FeatureDesc) of the writer
+	lx_uint32 uiCount;
+	DescCacheKey stKey;
+};
+
+struct DescCacheRecord
+{
+	lx_uint32 uiFeatureId;
+	lx_uint32 uiSize;
+};
+
+class DescCache
+{
+public:
+	DescCache();
+	~DescCache();
+
+	/* Maps path read-only. Returns false, with nothing mapped, if the file is missing,
+	   truncated, of another layout version or written for a different key. */
+	bool Open(const std::string& path, const DescCacheKey& key);
+	void Close();
+	bool IsOpen() const {return header_ != NULL;}
+
+	/* Copies the cached descriptor of featureId, false if the file has none */
+	bool Lookup(lx_uint32 featureId, CAM_FeatureDesc& desc) const;
+
+	/* Writes the count descriptors descs points to into a temporary file and then replaces path with it */
+	static bool Write(const std::string& path, const DescCacheKey& key, const CAM_FeatureDesc* const* descs, lx_uint32 count);
+
+	/* Descriptors whose ranges follow the current camera state are never cached */
+	static bool IsLive(lx_uint32 featureId);
+
+private:
+	DescCache(const DescCache&);
+	DescCache& operator=(const DescCache&);
+
+	HANDLE file_;
+	HANDLE mapping_;
+	const DescCacheHeader* header_;
+	const DescCacheRecord* record_[KSCAM_FEATURE_ID_COUNT];	// NULL if the file has no record for the id
+};
+
+#endif //_NIKONKS_DESCCACHE_H_
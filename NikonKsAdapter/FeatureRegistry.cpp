@@ -0,0 +1,206 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FeatureRegistry.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Feature id -> name / index / dependents / effects lookup tables
+//                and cached list labels
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "FeatureRegistry.h"
+#include <cstdlib>
+#include <cstring>
+
+///////////////////////////////////////////////////////////////////////////////
+// Feature names
+///////////////////////////////////////////////////////////////////////////////
+
+/* Indexed by ECamFeatureId, same entries and spelling as stFeatureNameRef. A const table of
+   literals is initialized at compile time, so no constexpr is needed (VS2013 has none). */
+static const char* const g_FeatureNames[KSCAM_FEATURE_ID_COUNT] =
+{
+    /*  0 */ NULL, "ExposureMode", "ExposureBias", "ExposureTime", "Gain",
+    /*  5 */ "MeteringMode", "MeteringArea", "ExposureTimeLimit", "GainLimit", "CaptureMode",
+    /* 10 */ NULL, NULL, NULL, "Brightness", "Sharpness",
+    /* 15 */ "Hue", "Saturation", NULL, "WhiteBalanceRed", "WhiteBalanceBlue",
+    /* 20 */ NULL, NULL, NULL, NULL, NULL,
+    /* 25 */ NULL, "Presets", NULL, NULL, NULL,
+    /* 30 */ NULL, NULL, NULL, "TriggerOption", NULL,
+    /* 35 */ "MultiExposureTime", "SignalExposureEnd", "SignalTriggerReady", "SignalDeviceCapture", "ExposureOutput",
+    /* 40 */ NULL, NULL, NULL, NULL, NULL,
+    /* 45 */ NULL, NULL, NULL, NULL, NULL,
+    /* 50 */ NULL, NULL, NULL, NULL, NULL,
+    /* 55 */ NULL, NULL, NULL, NULL, NULL,
+    /* 60 */ NULL, NULL, NULL, NULL, NULL,
+    /* 65 */ NULL, NULL, NULL, NULL, NULL,
+    /* 70 */ NULL, NULL, NULL, NULL, NULL,
+    /* 75 */ NULL, NULL, NULL, NULL, NULL,
+    /* 80 */ "Format", "RoiPosition", "TriggerMode",
+};
+
+const char* FeatureIdToName(lx_uint32 featureId)
+{
+    if (featureId < KSCAM_FEATURE_ID_COUNT && g_FeatureNames[featureId] != NULL)
+        return g_FeatureNames[featureId];
+    return "Unknown";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Feature dependents
+///////////////////////////////////////////////////////////////////////////////
+
+#define KSCAM_DEPENDENTS_MAX	7
+
+static const struct
+{
+    lx_uint32 featureId;
+    lx_uint32 dependents[KSCAM_DEPENDENTS_MAX + 1];
+} g_FeatureDependents[] =
+{
+    {eFormat,            {eRoiPosition, eMeteringArea, eExposureTime, eExposureTimeLimit, eUnknown}},
+    {eExposureMode,      {eExposureTime, eGain, eExposureBias, eMultiExposureTime, eUnknown}},
+    {eExposureTimeLimit, {eExposureTime, eUnknown}},
+    {eGainLimit,         {eGain, eUnknown}},
+    {eCaptureMode,       {eExposureTime, eGain, eUnknown}},
+    {eMeteringMode,      {eMeteringArea, eUnknown}},
+    {ePresets,           {eBrightness, eSharpness, eHue, eSaturation, eWhiteBalanceRed, eWhiteBalanceBlue, eUnknown}},
+    {eTriggerMode,       {eTriggerOption, eUnknown}},
+};
+
+const lx_uint32* FeatureDependents(lx_uint32 featureId)
+{
+    static const lx_uint32 none[1] = {eUnknown};
+
+    for (size_t i = 0; i < sizeof(g_FeatureDependents) / sizeof(g_FeatureDependents[0]); i++)
+    {
+        if (g_FeatureDependents[i].featureId == featureId)
+            return g_FeatureDependents[i].dependents;
+    }
+    return none;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Feature effects
+///////////////////////////////////////////////////////////////////////////////
+
+unsigned FeatureEffects(lx_uint32 featureId)
+{
+    switch (featureId)
+    {
+    case eFormat:
+        return efeGeometry | efeLimits | efeTiming;
+    case eCaptureMode:
+    case eExposureMode:
+    case eExposureTime:
+    case eExposureTimeLimit:
+    case eMultiExposureTime:
+    case eTriggerMode:
+    case eTriggerOption:
+        return efeTiming;
+    default:
+        return efeNone;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FeatureIndex
+///////////////////////////////////////////////////////////////////////////////
+
+void FeatureIndex::Clear()
+{
+    for (lx_uint32 i = 0; i < KSCAM_FEATURE_ID_COUNT; i++)
+        index_[i] = KSCAM_FEATURE_NONE;
+}
+
+void FeatureIndex::Set(lx_uint32 featureId, lx_uint32 index)
+{
+    if (featureId < KSCAM_FEATURE_ID_COUNT)
+        index_[featureId] = index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FeatureLabelCache
+///////////////////////////////////////////////////////////////////////////////
+
+void FeatureLabelCache::Clear()
+{
+    MMThreadGuard g(lock_);
+    for (lx_uint32 i = 0; i < KSCAM_FEATURE_ID_COUNT; i++)
+    {
+        labels_[i].clear();
+        valid_[i] = false;
+    }
+}
+
+void FeatureLabelCache::Invalidate(lx_uint32 featureId)
+{
+    MMThreadGuard g(lock_);
+    if (featureId < KSCAM_FEATURE_ID_COUNT)
+        valid_[featureId] = false;
+}
+
+/* Caller holds lock_ */
+const std::vector<std::string>& FeatureLabelCache::Labels(const CAM_FeatureDesc& desc)
+{
+    lx_uint32 featureId = desc.uiFeatureId;
+    if (featureId >= KSCAM_FEATURE_ID_COUNT)
+        return empty_;
+    if (valid_[featureId])
+        return labels_[featureId];
+
+    char strWork[CAM_FEA_COMMENT_MAX * 2];
+    std::vector<std::string>& labels = labels_[featureId];
+    labels.clear();
+    for (lx_uint32 i = 0; i < desc.uiListCount; i++)
+    {
+        const lx_wchar* comment;
+        if (desc.eFeatureDescType == edesc_FormatList)
+            comment = desc.stFormatList[i].wszComment;
+        else if (desc.eFeatureDescType == edesc_ElementList)
+            comment = desc.stElementList[i].wszComment;
+        else
+            break;
+
+        size_t length = wcstombs(strWork, reinterpret_cast<wchar_t const*>(comment), sizeof(strWork) - 1);
+        if (length == (size_t)-1)
+            length = 0;
+        strWork[length] = '\0';
+        labels.push_back(strWork);
+    }
+    valid_[featureId] = true;
+    return labels;
+}
+
+bool FeatureLabelCache::Label(const CAM_FeatureDesc& desc, lx_uint32 index, std::string& label)
+{
+    MMThreadGuard g(lock_);
+    const std::vector<std::string>& labels = Labels(desc);
+    if (index >= labels.size())
+        return false;
+    label = labels[index];
+    return true;
+}
+
+int FeatureLabelCache::Find(const CAM_FeatureDesc& desc, const std::string& label)
+{
+    MMThreadGuard g(lock_);
+    const std::vector<std::string>& labels = Labels(desc);
+    for (size_t i = 0; i < labels.size(); i++)
+    {
+        if (labels[i] == label)
+            return (int)i;
+    }
+    return -1;
+}
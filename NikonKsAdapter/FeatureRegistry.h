@@ -0,0 +1,101 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FeatureRegistry.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Feature id -> name / index / dependents / effects lookup tables
+//                and cached list labels
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_FEATUREREGISTRY_H_
+#define _NIKONKS_FEATUREREGISTRY_H_
+
+#include "../../../MMDevice/DeviceThreads.h"
+
+#include <KsCam.h>
+#include <KsCamFeature.h>
+
+#include <string>
+#include <vector>
+
+/* Every ECamFeatureId is below this */
+#define KSCAM_FEATURE_ID_COUNT	83
+#define KSCAM_FEATURE_NONE		0xFFFFFFFF
+
+/* Narrow name of a feature as in stFeatureNameRef, "Unknown" for ids the SDK does not name.
+   Returns a string literal, nothing is allocated. */
+const char* FeatureIdToName(lx_uint32 featureId);
+
+/* Derived adapter state a feature write invalidates */
+enum EFeatureEffect
+{
+	efeNone		= 0,
+	efeGeometry	= 0x1,	// image size, pixel type and frame buffers (UpdateImageSettings)
+	efeLimits	= 0x2,	// ROI position and metering area property limits
+	efeTiming	= 0x4,	// frame interval reported by CAM_CMD_GET_FRAMESIZE
+	efeAll		= 0x7,
+};
+
+/* Combination of EFeatureEffect for featureId, efeNone for features nothing else depends on */
+unsigned FeatureEffects(lx_uint32 featureId);
+
+/* Features the camera may change by itself when featureId is written, eUnknown terminated.
+   Never NULL, features without dependents return an empty list. */
+const lx_uint32* FeatureDependents(lx_uint32 featureId);
+
+/* Feature id -> position in the vectFeatureValue_ / featureDesc_ arrays */
+class FeatureIndex
+{
+public:
+	FeatureIndex() {Clear();}
+
+	void Clear();
+	void Set(lx_uint32 featureId, lx_uint32 index);
+	bool Has(lx_uint32 featureId) const {return featureId < KSCAM_FEATURE_ID_COUNT && index_[featureId] != KSCAM_FEATURE_NONE;}
+
+	/* Features the camera does not have map to index 0 */
+	lx_uint32 operator[](lx_uint32 featureId) const {return Has(featureId) ? index_[featureId] : 0;}
+
+private:
+	lx_uint32 index_[KSCAM_FEATURE_ID_COUNT];
+};
+
+/* Narrow labels of element list and format list descriptors, converted with wcstombs
+   once per descriptor instead of on every property get/set. Invalidate() is called from
+   the event thread, so lookups copy out under the lock. */
+class FeatureLabelCache
+{
+public:
+	FeatureLabelCache() {Clear();}
+
+	void Clear();
+	/* Call whenever the descriptor of featureId was fetched again */
+	void Invalidate(lx_uint32 featureId);
+
+	/* Label of list entry index, false if there is no such entry */
+	bool Label(const CAM_FeatureDesc& desc, lx_uint32 index, std::string& label);
+	/* Position of label in the descriptor list, -1 if it is not there */
+	int Find(const CAM_FeatureDesc& desc, const std::string& label);
+
+private:
+	const std::vector<std::string>& Labels(const CAM_FeatureDesc& desc);
+
+	MMThreadLock lock_;
+	std::vector<std::string> labels_[KSCAM_FEATURE_ID_COUNT];
+	bool valid_[KSCAM_FEATURE_ID_COUNT];
+	std::vector<std::string> empty_;
+};
+
+#endif //_NIKONKS_FEATUREREGISTRY_H_
@@ -0,0 +1,195 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FormatTable.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image formats of the camera with their precomputed buffer layout,
+//                conversion routine and ROI / metering limits
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "FormatTable.h"
+
+#include <algorithm>
+
+/* ROI modes are a window into the full frame mode of the same scale */
+static ECamFormatMode FullFrameMode(ECamFormatMode mode)
+{
+    switch (mode)
+    {
+    case ecfm2454x1632:
+        return ecfm4908x3264;
+    case ecfm818x544:
+        return ecfm1636x1088;
+    case ecfm804x804:
+        return ecfm1608x1608;
+    default:
+        return mode;
+    }
+}
+
+/* Full resolution mode of the sensor area a mode covers */
+static ECamFormatMode SensorMode(ECamFormatMode mode)
+{
+    switch (mode)
+    {
+    case ecfm2454x1632:
+    case ecfm1636x1088:
+    case ecfm818x544:
+        return ecfm4908x3264;
+    case ecfm804x804:
+    case ecfm536x536:
+        return ecfm1608x1608;
+    default:
+        return mode;
+    }
+}
+
+static bool SmallerFormat(const KsFormat* a, const KsFormat* b)
+{
+    return (size_t)a->uiWidth * a->uiHeight < (size_t)b->uiWidth * b->uiHeight;
+}
+
+/* First position on the min + n * res grid that keeps [start, start + size) inside [pos, pos + window) */
+static bool PlaceRoiAxis(lx_uint32 start, lx_uint32 size, lx_uint32 window, lx_uint32 min, lx_uint32 max, lx_uint32 res, lx_uint32& pos)
+{
+    if (size > window)
+        return false;
+    if (res == 0)
+        res = 1;
+
+    lx_uint32 lowest = start + size > window ? start + size - window : 0;
+    if (lowest < min)
+        lowest = min;
+    pos = min + (lowest - min + res - 1) / res * res;
+    return pos <= start && pos <= max;
+}
+
+void FormatTable::Build(const CAM_FeatureDesc& formatDesc, ECpuSimdLevel level)
+{
+    formats_.clear();
+    if (formatDesc.eFeatureDescType != edesc_FormatList)
+        return;
+
+    for (lx_uint32 i = 0; i < formatDesc.uiListCount && i < CAM_FEA_DESK_LIST_MAX; i++)
+    {
+        const CAM_FeatureDescFormat& desc = formatDesc.stFormatList[i];
+        KsFormat format;
+
+        format.stFormat = desc.stFormat;
+        format.uiWidth = desc.uiImageWidth;
+        format.uiHeight = desc.uiImageHeight;
+        format.uiBitPerPixel = desc.uiBitPerPixel;
+        format.srcRowBytes = (size_t)desc.uiImageWidth * desc.uiBitPerPixel / 8;
+        format.uiFrameSize = 0;
+        format.stDescArea = desc.stDescArea;
+        format.stDescPosition = desc.stDescPosition;
+        format.eFullMode = FullFrameMode(desc.stFormat.eMode);
+        format.roi = format.eFullMode != desc.stFormat.eMode;
+        format.eSensorMode = SensorMode(desc.stFormat.eMode);
+        format.hwBin = (desc.stFormat.eMode == ecfm1636x1088 || desc.stFormat.eMode == ecfm818x544 ||
+                        desc.stFormat.eMode == ecfm536x536) ? 3 : 1;
+
+        /* Anything else is not something MMCore can show */
+        if (desc.stFormat.eColor != ecfcRgb24 && desc.stFormat.eColor != ecfcYuv444 && desc.stFormat.eColor != ecfcMono16)
+            continue;
+        SetOutputMode(format, eomBGRA, level);
+        formats_.push_back(format);
+    }
+}
+
+void SetOutputMode(KsFormat& format, EOutputMode outputMode, ECpuSimdLevel level)
+{
+    bool yuv = format.stFormat.eColor == ecfcYuv444;
+
+    if (format.stFormat.eColor == ecfcMono16)
+    {
+        format.byteDepth = 2;
+        format.numComponents = 1;
+        format.bitDepth = 16;
+        format.color = false;
+        format.convert = CopyMono16;
+        format.bin = SelectBinMono16(level);
+        return;
+    }
+
+    switch (outputMode)
+    {
+    case eomLuminance16:
+        format.byteDepth = 2;
+        format.numComponents = 1;
+        format.bitDepth = 16;
+        format.color = false;
+        format.convert = yuv ? SelectYuv444ToLuma16(level) : SelectBgr8ToLuma16(level);
+        format.bin = SelectBinMono16(level);
+        break;
+    case eomGreen8:
+        format.byteDepth = 1;
+        format.numComponents = 1;
+        format.bitDepth = 8;
+        format.color = false;
+        format.convert = yuv ? SelectYuv444ToGreen8(level) : SelectBgr8ToGreen8(level);
+        format.bin = SelectBinMono8(level);
+        break;
+    default:
+        format.byteDepth = 4;
+        format.numComponents = 4;
+        format.bitDepth = 8;
+        format.color = true;
+        format.convert = yuv ? SelectYuv444ToBGRA8(level) : SelectBgr8ToBGRA8(level);
+        format.bin = SelectBinBGRA8(level);
+        break;
+    }
+}
+
+KsFormat* FormatTable::Find(const CAM_Format& format)
+{
+    for (size_t i = 0; i < formats_.size(); i++)
+    {
+        if (formats_[i].stFormat.eColor == format.eColor && formats_[i].stFormat.eMode == format.eMode)
+            return &formats_[i];
+    }
+    return NULL;
+}
+
+void FormatTable::FindCovering(const CAM_Format& full, lx_uint32 width, lx_uint32 height, std::vector<KsFormat*>& covering)
+{
+    covering.clear();
+    for (size_t i = 0; i < formats_.size(); i++)
+    {
+        if (formats_[i].stFormat.eColor == full.eColor && formats_[i].eFullMode == full.eMode &&
+            formats_[i].uiWidth >= width && formats_[i].uiHeight >= height)
+            covering.push_back(&formats_[i]);
+    }
+    std::sort(covering.begin(), covering.end(), SmallerFormat);
+}
+
+KsFormat* FormatTable::FindBinned(ECamFormatColor color, ECamFormatMode sensorMode, unsigned hwBin)
+{
+    for (size_t i = 0; i < formats_.size(); i++)
+    {
+        if (formats_[i].stFormat.eColor == color && formats_[i].eSensorMode == sensorMode &&
+            formats_[i].hwBin == hwBin && !formats_[i].roi)
+            return &formats_[i];
+    }
+    return NULL;
+}
+
+bool PlaceRoiWindow(const KsFormat& format, lx_uint32 x, lx_uint32 y, lx_uint32 width, lx_uint32 height, CAM_Position& position)
+{
+    const CAM_FeatureDescPosition& desc = format.stDescPosition;
+
+    return PlaceRoiAxis(x, width, format.uiWidth, desc.stMin.uiX, desc.stMax.uiX, desc.stRes.uiX, position.uiX) &&
+           PlaceRoiAxis(y, height, format.uiHeight, desc.stMin.uiY, desc.stMax.uiY, desc.stRes.uiY, position.uiY);
+}
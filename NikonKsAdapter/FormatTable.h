@@ -0,0 +1,90 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FormatTable.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image formats of the camera with their precomputed buffer layout,
+//                conversion routine and ROI / metering limits
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_FORMATTABLE_H_
+#define _NIKONKS_FORMATTABLE_H_
+
+#include <KsCam.h>
+#include <KsCamFeature.h>
+
+#include "ImageConvert.h"
+
+#include <vector>
+
+/* What color formats are handed to MMCore as */
+enum EOutputMode
+{
+	eomBGRA			= 0,	// 32 bit color
+	eomLuminance16	= 1,	// BT.601 luma scaled to 16 bits
+	eomGreen8		= 2,	// green channel only
+};
+
+/* One entry of the eFormat list with everything a format switch needs */
+struct KsFormat
+{
+	CAM_Format stFormat;
+	lx_uint32 uiWidth;
+	lx_uint32 uiHeight;				// without the footer
+	lx_uint32 uiBitPerPixel;		// driver frame
+	int byteDepth;					// bytes per pixel handed to MMCore
+	int numComponents;
+	int bitDepth;
+	bool color;						// MMCore gets color pixels
+	size_t srcRowBytes;				// driver frame row
+	ConvertFunc convert;			// driver row -> MMCore row
+	BinFunc bin;					// software binning of MMCore pixels (driver pixels for Mono16)
+	lx_uint32 uiFrameSize;			// CAM_CMD_GET_FRAMESIZE, 0 until asked once with this format active
+	CAM_FeatureDescArea stDescArea;			// metering area limits
+	CAM_FeatureDescPosition stDescPosition;	// ROI position limits
+	ECamFormatMode eFullMode;		// full frame mode of the same scale, eMode itself unless this is an ROI mode
+	bool roi;						// window into eFullMode placed with eRoiPosition
+	ECamFormatMode eSensorMode;		// unbinned full frame mode
+	unsigned hwBin;					// 3 for the 1/3 average modes, 1 otherwise
+};
+
+class FormatTable
+{
+public:
+	/* Rebuilds the table from the eFormat descriptor, conversion routines for level */
+	void Build(const CAM_FeatureDesc& formatDesc, ECpuSimdLevel level);
+	void Clear() {formats_.clear();}
+	bool Empty() const {return formats_.empty();}
+
+	/* NULL if format is not in the table */
+	KsFormat* Find(const CAM_Format& format);
+	/* Formats of the same color and full frame mode as full that are at least width x height,
+	   smallest first. full itself is included when it is large enough. */
+	void FindCovering(const CAM_Format& full, lx_uint32 width, lx_uint32 height, std::vector<KsFormat*>& covering);
+	/* Full frame (not ROI) format of color and sensorMode with hardware binning hwBin, NULL if none */
+	KsFormat* FindBinned(ECamFormatColor color, ECamFormatMode sensorMode, unsigned hwBin);
+
+private:
+	std::vector<KsFormat> formats_;
+};
+
+/* Switches the MMCore pixel layout and routines of a color format to outputMode, Mono16 formats are left alone */
+void SetOutputMode(KsFormat& format, EOutputMode outputMode, ECpuSimdLevel level);
+
+/* Position for an ROI format's window so it contains the x, y, width, height rectangle of the
+   full frame, within the stDescPosition limits. False if no position does. */
+bool PlaceRoiWindow(const KsFormat& format, lx_uint32 x, lx_uint32 y, lx_uint32 width, lx_uint32 height, CAM_Position& position);
+
+#endif //_NIKONKS_FORMATTABLE_H_
@@ -0,0 +1,161 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FramePool.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pool of reference counted, cache line aligned frame buffers
+//                passed to CAM_GetImage
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifdef WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#endif
+#include "FramePool.h"
+#include <malloc.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// KsFrame
+///////////////////////////////////////////////////////////////////////////////
+
+KsFrame::KsFrame(FramePool* pool, lx_uint32 frameSize, lx_uint32 generation) :
+    pool_(pool),
+    generation_(generation),
+    receivedTick_(0)
+{
+    pDataBuffer = _aligned_malloc(frameSize, FRAMEPOOL_ALIGNMENT);
+    uiDataBufferSize = pDataBuffer != NULL ? frameSize : 0;
+}
+
+KsFrame::~KsFrame()
+{
+    _aligned_free(pDataBuffer);
+}
+
+lx_uint32 KsFrame::AddRef()
+{
+    return InterlockedIncrement(reinterpret_cast<volatile LONG*>(&uiRefCount));
+}
+
+void KsFrame::Release()
+{
+    if (InterlockedDecrement(reinterpret_cast<volatile LONG*>(&uiRefCount)) == 0)
+        pool_->Recycle(this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FramePool
+///////////////////////////////////////////////////////////////////////////////
+
+FramePool::FramePool() :
+    frameSize_(0),
+    generation_(0),
+    slotCount_(0),
+    allocated_(0)
+{
+}
+
+FramePool::~FramePool()
+{
+    Clear();
+}
+
+void FramePool::Resize(lx_uint32 frameSize, unsigned slotCount)
+{
+    MMThreadGuard g(lock_);
+
+    if (frameSize != frameSize_)
+    {
+        /* Buffers still in use belong to the old generation and are freed on release */
+        FreeIdle();
+        allocated_ = 0;
+        generation_++;
+        frameSize_ = frameSize;
+    }
+    slotCount_ = slotCount;
+
+    while (allocated_ > slotCount_ && !idle_.empty())
+    {
+        delete idle_.back();
+        idle_.pop_back();
+        allocated_--;
+    }
+}
+
+void FramePool::Clear()
+{
+    MMThreadGuard g(lock_);
+    FreeIdle();
+}
+
+void FramePool::FreeIdle()
+{
+    for (size_t i = 0; i < idle_.size(); i++)
+    {
+        delete idle_[i];
+        allocated_--;
+    }
+    idle_.clear();
+}
+
+KsFrame* FramePool::Acquire()
+{
+    MMThreadGuard g(lock_);
+    KsFrame* frame = NULL;
+
+    if (!idle_.empty())
+    {
+        frame = idle_.back();
+        idle_.pop_back();
+    }
+    else if (allocated_ < slotCount_ && frameSize_ > 0)
+    {
+        /* Buffers are only allocated once they are needed, so memory follows the active format */
+        frame = new KsFrame(this, frameSize_, generation_);
+        if (frame->pDataBuffer == NULL)
+        {
+            delete frame;
+            return NULL;
+        }
+        allocated_++;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    frame->uiRefCount = 1;
+    frame->uiImageSize = 0;
+    frame->receivedTick_ = 0;
+    return frame;
+}
+
+void FramePool::Recycle(KsFrame* frame)
+{
+    MMThreadGuard g(lock_);
+
+    if (frame->generation_ != generation_)
+    {
+        delete frame;
+        return;
+    }
+    if (allocated_ > slotCount_)
+    {
+        delete frame;
+        allocated_--;
+        return;
+    }
+    idle_.push_back(frame);
+}
@@ -0,0 +1,95 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FramePool.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pool of reference counted, cache line aligned frame buffers
+//                passed to CAM_GetImage
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_FRAMEPOOL_H_
+#define _NIKONKS_FRAMEPOOL_H_
+
+#include "../../../MMDevice/DeviceThreads.h"
+
+#include <KsCam.h>
+#include <KsCamImage.h>
+
+#include <vector>
+
+#define FRAMEPOOL_ALIGNMENT		64
+
+class FramePool;
+
+/* One driver frame (pixels followed by the CAM_ImageInfo footer).
+   Acquired with a reference count of 1, Release() hands it back to the pool. */
+class KsFrame : public CAM_Image
+{
+	friend class FramePool;
+
+public:
+	lx_uint32 AddRef();
+	void Release();
+
+	const unsigned char* GetData() const {return static_cast<const unsigned char*>(pDataBuffer);}
+	/* Footer behind the pixels, valid after CAM_GetImage filled uiImageSize */
+	const CAM_ImageInfo* GetInfo() const {return reinterpret_cast<const CAM_ImageInfo*>(GetData() + uiImageSize);}
+
+	/* Performance counter time the driver reported this frame, 0 if unknown */
+	lx_int64 GetReceivedTick() const {return receivedTick_;}
+	void SetReceivedTick(lx_int64 tick) {receivedTick_ = tick;}
+
+private:
+	KsFrame(FramePool* pool, lx_uint32 frameSize, lx_uint32 generation);
+	~KsFrame();
+
+	FramePool* pool_;
+	lx_uint32 generation_;
+	lx_int64 receivedTick_;
+};
+
+class FramePool
+{
+	friend class KsFrame;
+
+public:
+	FramePool();
+	~FramePool();
+
+	/* Sets the buffer size and the maximum number of frames in flight.
+	   Idle buffers of the old size are freed now, busy ones when they are released. */
+	void Resize(lx_uint32 frameSize, unsigned slotCount);
+	/* Frees every idle buffer */
+	void Clear();
+
+	/* Returns NULL when every slot is in use */
+	KsFrame* Acquire();
+
+	lx_uint32 GetFrameSize() const {return frameSize_;}
+	unsigned GetSlotCount() const {return slotCount_;}
+
+private:
+	void Recycle(KsFrame* frame);
+	void FreeIdle();
+
+	MMThreadLock lock_;
+	std::vector<KsFrame*> idle_;
+	lx_uint32 frameSize_;
+	lx_uint32 generation_;
+	unsigned slotCount_;
+	unsigned allocated_;
+};
+
+#endif //_NIKONKS_FRAMEPOOL_H_
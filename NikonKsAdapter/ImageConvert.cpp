@@ -0,0 +1,671 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ImageConvert.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pixel conversion kernels for the NikonKsCam adapter
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "ImageConvert.h"
+#include <cstring>
+#include <intrin.h>
+#include <tmmintrin.h>
+#ifdef NIKONKS_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+/* gcc and clang only emit the instructions of a level inside functions marked for it, so the
+   scalar kernels and everything else build for the baseline CPU. MSVC needs no marking. */
+#if defined(__GNUC__)
+#define NIKONKS_TARGET_SSSE3    __attribute__((target("ssse3")))
+#define NIKONKS_TARGET_AVX2     __attribute__((target("avx2")))
+#else
+#define NIKONKS_TARGET_SSSE3
+#define NIKONKS_TARGET_AVX2
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// CPU feature detection
+///////////////////////////////////////////////////////////////////////////////
+
+ECpuSimdLevel GetCpuSimdLevel()
+{
+    int info[4];
+
+    __cpuid(info, 0);
+    auto maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    /* ECX bit 9 = SSSE3 */
+    if ((info[2] & (1 << 9)) == 0)
+        return ecslScalar;
+
+#ifdef NIKONKS_HAVE_AVX2
+    /* ECX bit 27 = OSXSAVE, bit 28 = AVX. The OS must also save the YMM state (XCR0 bits 1 and 2) */
+    if (maxLeaf >= 7 && (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0)
+    {
+        if ((_xgetbv(0) & 0x6) == 0x6)
+        {
+            __cpuidex(info, 7, 0);
+            /* EBX bit 5 = AVX2 */
+            if ((info[1] & (1 << 5)) != 0)
+                return ecslAVX2;
+        }
+    }
+#endif
+    return ecslSSSE3;
+}
+
+const char* GetCpuSimdLevelName(ECpuSimdLevel level)
+{
+    switch (level)
+    {
+    case ecslAVX2:
+        return "AVX2";
+    case ecslSSSE3:
+        return "SSSE3";
+    default:
+        return "Scalar";
+    }
+}
+
+/* Splits 16 packed 3 byte pixels, held in three 16 byte loads, into one register per byte of the pixel */
+NIKONKS_TARGET_SSSE3 static inline void Deinterleave3x16_SSSE3(__m128i a, __m128i b, __m128i c, __m128i& p0, __m128i& p1, __m128i& p2)
+{
+    const __m128i m00 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i m01 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i m02 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i m10 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i m11 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i m12 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i m20 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i m21 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i m22 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+    p0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m00), _mm_shuffle_epi8(b, m01)), _mm_shuffle_epi8(c, m02));
+    p1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m10), _mm_shuffle_epi8(b, m11)), _mm_shuffle_epi8(c, m12));
+    p2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m20), _mm_shuffle_epi8(b, m21)), _mm_shuffle_epi8(c, m22));
+}
+
+NIKONKS_TARGET_SSSE3 static inline void Load3x16(const unsigned char* s, __m128i& a, __m128i& b, __m128i& c)
+{
+    a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+    c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BGR24 -> BGRA32
+///////////////////////////////////////////////////////////////////////////////
+
+//copied from MM dc1394.cpp driver file
+//EF: converts bgr image to Micromanager BGRA
+// It is the callers responsibility that both src and destination exist
+void Bgr8ToBGRA8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    for (size_t i = 0, j = 0; i < (pixelCount * 3); i += 3, j += 4)
+    {
+        dest[j] = src[i];
+        dest[j + 1] = src[i + 1];
+        dest[j + 2] = src[i + 2];
+        dest[j + 3] = 0;
+    }
+}
+
+/* 16 pixels per iteration: three 16 byte loads are realigned to 12 byte (4 pixel) groups,
+   then a byte shuffle inserts the zero alpha byte. Never reads past the last source pixel. */
+NIKONKS_TARGET_SSSE3 void Bgr8ToBGRA8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    size_t i = 0;
+
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        const unsigned char* s = src + i * 3;
+        __m128i* d = reinterpret_cast<__m128i*>(dest + i * 4);
+
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+
+        _mm_storeu_si128(d,     _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128(d + 1, _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask));
+        _mm_storeu_si128(d + 2, _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask));
+        _mm_storeu_si128(d + 3, _mm_shuffle_epi8(_mm_srli_si128(c, 4), mask));
+    }
+
+    Bgr8ToBGRA8_Scalar(dest + i * 4, src + i * 3, pixelCount - i);
+}
+
+#ifdef NIKONKS_HAVE_AVX2
+/* 32 pixels per iteration: each 32 byte load holds 8 pixels, a dword permute moves
+   pixels 4..7 into the upper lane so the same in-lane shuffle as SSSE3 can be used.
+   Each load reads 8 bytes past its 24 byte group, so the last 35 pixels are left to SSSE3. */
+NIKONKS_TARGET_AVX2 void Bgr8ToBGRA8_AVX2(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    const __m256i mask = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                          0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i perm = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    size_t i = 0;
+
+    for (; i + 35 <= pixelCount; i += 32)
+    {
+        const unsigned char* s = src + i * 3;
+        __m256i* d = reinterpret_cast<__m256i*>(dest + i * 4);
+
+        for (int k = 0; k < 4; k++)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + k * 24));
+            v = _mm256_permutevar8x32_epi32(v, perm);
+            _mm256_storeu_si256(d + k, _mm256_shuffle_epi8(v, mask));
+        }
+    }
+    _mm256_zeroupper();
+
+    Bgr8ToBGRA8_SSSE3(dest + i * 4, src + i * 3, pixelCount - i);
+}
+#endif
+
+ConvertFunc SelectBgr8ToBGRA8(ECpuSimdLevel level)
+{
+#ifdef NIKONKS_HAVE_AVX2
+    if (level >= ecslAVX2)
+        return Bgr8ToBGRA8_AVX2;
+#endif
+    if (level >= ecslSSSE3)
+        return Bgr8ToBGRA8_SSSE3;
+    return Bgr8ToBGRA8_Scalar;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// YUV444 -> BGRA32
+///////////////////////////////////////////////////////////////////////////////
+
+/* Full range BT.601 in Q14: 1.402, 0.344, 0.714, 1.772 */
+#define YUV_Q14_RV		22970
+#define YUV_Q14_GU		5638
+#define YUV_Q14_GV		11700
+#define YUV_Q14_BU		29032
+#define YUV_Q14_ROUND	8192
+
+static inline unsigned char ClampByte(int value)
+{
+    return (unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+void Yuv444ToBGRA8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    for (size_t i = 0, j = 0; i < (pixelCount * 3); i += 3, j += 4)
+    {
+        int y = src[i];
+        int u = src[i + 1] - 128;
+        int v = src[i + 2] - 128;
+
+        dest[j] = ClampByte(y + ((YUV_Q14_BU * u + YUV_Q14_ROUND) >> 14));
+        dest[j + 1] = ClampByte(y - ((YUV_Q14_GU * u + YUV_Q14_GV * v + YUV_Q14_ROUND) >> 14));
+        dest[j + 2] = ClampByte(y + ((YUV_Q14_RV * v + YUV_Q14_ROUND) >> 14));
+        dest[j + 3] = 0;
+    }
+}
+
+/* G of 8 pixels in 16 bit lanes. Both terms are summed before rounding, so this goes through pmaddwd on (u, v) pairs. */
+NIKONKS_TARGET_SSSE3 static inline __m128i Yuv444ToG16_SSSE3(__m128i y, __m128i u, __m128i v)
+{
+    const __m128i guv = _mm_setr_epi16(YUV_Q14_GU, YUV_Q14_GV, YUV_Q14_GU, YUV_Q14_GV,
+                                       YUV_Q14_GU, YUV_Q14_GV, YUV_Q14_GU, YUV_Q14_GV);
+    const __m128i round = _mm_set1_epi32(YUV_Q14_ROUND);
+
+    __m128i glo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(u, v), guv), round), 14);
+    __m128i ghi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(u, v), guv), round), 14);
+    return _mm_sub_epi16(y, _mm_packs_epi32(glo, ghi));
+}
+
+/* 8 pixels of one half: B and R use pmulhrsw, which is exactly (c * x + 8192) >> 14 when x is doubled first */
+NIKONKS_TARGET_SSSE3 static inline void Yuv444ToBgr16_SSSE3(__m128i y, __m128i u, __m128i v, __m128i& b, __m128i& g, __m128i& r)
+{
+    const __m128i bu = _mm_set1_epi16(YUV_Q14_BU);
+    const __m128i rv = _mm_set1_epi16(YUV_Q14_RV);
+
+    b = _mm_add_epi16(y, _mm_mulhrs_epi16(_mm_slli_epi16(u, 1), bu));
+    r = _mm_add_epi16(y, _mm_mulhrs_epi16(_mm_slli_epi16(v, 1), rv));
+    g = Yuv444ToG16_SSSE3(y, u, v);
+}
+
+/* 16 pixels per iteration: Y, Cb and Cr are gathered out of three 16 byte loads with byte
+   shuffles, converted in 16 bit lanes and saturated by the final unsigned pack.
+   Gives the same result as the scalar version. */
+NIKONKS_TARGET_SSSE3 void Yuv444ToBGRA8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    size_t i = 0;
+
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i* d = reinterpret_cast<__m128i*>(dest + i * 4);
+        __m128i a, b, c, y, u, v;
+
+        Load3x16(src + i * 3, a, b, c);
+        Deinterleave3x16_SSSE3(a, b, c, y, u, v);
+
+        __m128i blo, glo, rlo, bhi, ghi, rhi;
+        Yuv444ToBgr16_SSSE3(_mm_unpacklo_epi8(y, zero), _mm_sub_epi16(_mm_unpacklo_epi8(u, zero), bias),
+                            _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias), blo, glo, rlo);
+        Yuv444ToBgr16_SSSE3(_mm_unpackhi_epi8(y, zero), _mm_sub_epi16(_mm_unpackhi_epi8(u, zero), bias),
+                            _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias), bhi, ghi, rhi);
+
+        __m128i b8 = _mm_packus_epi16(blo, bhi);
+        __m128i g8 = _mm_packus_epi16(glo, ghi);
+        __m128i r8 = _mm_packus_epi16(rlo, rhi);
+
+        __m128i bgLo = _mm_unpacklo_epi8(b8, g8);
+        __m128i bgHi = _mm_unpackhi_epi8(b8, g8);
+        __m128i raLo = _mm_unpacklo_epi8(r8, zero);
+        __m128i raHi = _mm_unpackhi_epi8(r8, zero);
+
+        _mm_storeu_si128(d,     _mm_unpacklo_epi16(bgLo, raLo));
+        _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(bgLo, raLo));
+        _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(bgHi, raHi));
+        _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(bgHi, raHi));
+    }
+
+    Yuv444ToBGRA8_Scalar(dest + i * 4, src + i * 3, pixelCount - i);
+}
+
+ConvertFunc SelectYuv444ToBGRA8(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return Yuv444ToBGRA8_SSSE3;
+    return Yuv444ToBGRA8_Scalar;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Color -> single plane
+///////////////////////////////////////////////////////////////////////////////
+
+/* BT.601 luma in Q8: 0.114, 0.587, 0.299. The weights add up to 256, so the sum is an 8 bit luma scaled to 16 bits */
+#define LUMA_Q8_B		29
+#define LUMA_Q8_G		150
+#define LUMA_Q8_R		77
+
+void Bgr8ToLuma16_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    unsigned short* d = reinterpret_cast<unsigned short*>(dest);
+    for (size_t i = 0; i < pixelCount; i++, src += 3)
+        d[i] = (unsigned short)(LUMA_Q8_B * src[0] + LUMA_Q8_G * src[1] + LUMA_Q8_R * src[2]);
+}
+
+/* 16 pixels per iteration, the weighted sum never exceeds 65280 so plain 16 bit multiplies are enough */
+NIKONKS_TARGET_SSSE3 void Bgr8ToLuma16_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    const __m128i wb = _mm_set1_epi16(LUMA_Q8_B);
+    const __m128i wg = _mm_set1_epi16(LUMA_Q8_G);
+    const __m128i wr = _mm_set1_epi16(LUMA_Q8_R);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i* d = reinterpret_cast<__m128i*>(dest + i * 2);
+        __m128i a, b, c, pb, pg, pr;
+
+        Load3x16(src + i * 3, a, b, c);
+        Deinterleave3x16_SSSE3(a, b, c, pb, pg, pr);
+
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb),
+                                                 _mm_mullo_epi16(_mm_unpacklo_epi8(pg, zero), wg)),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(pr, zero), wr));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb),
+                                                 _mm_mullo_epi16(_mm_unpackhi_epi8(pg, zero), wg)),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(pr, zero), wr));
+        _mm_storeu_si128(d,     lo);
+        _mm_storeu_si128(d + 1, hi);
+    }
+
+    Bgr8ToLuma16_Scalar(dest + i * 2, src + i * 3, pixelCount - i);
+}
+
+ConvertFunc SelectBgr8ToLuma16(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return Bgr8ToLuma16_SSSE3;
+    return Bgr8ToLuma16_Scalar;
+}
+
+void Bgr8ToGreen8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; i++)
+        dest[i] = src[i * 3 + 1];
+}
+
+NIKONKS_TARGET_SSSE3 void Bgr8ToGreen8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i a, b, c, pb, pg, pr;
+
+        Load3x16(src + i * 3, a, b, c);
+        Deinterleave3x16_SSSE3(a, b, c, pb, pg, pr);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), pg);
+    }
+
+    Bgr8ToGreen8_Scalar(dest + i, src + i * 3, pixelCount - i);
+}
+
+ConvertFunc SelectBgr8ToGreen8(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return Bgr8ToGreen8_SSSE3;
+    return Bgr8ToGreen8_Scalar;
+}
+
+/* Y already is the luma, it only moves to the high byte */
+void Yuv444ToLuma16_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    unsigned short* d = reinterpret_cast<unsigned short*>(dest);
+    for (size_t i = 0; i < pixelCount; i++)
+        d[i] = (unsigned short)(src[i * 3] << 8);
+}
+
+NIKONKS_TARGET_SSSE3 void Yuv444ToLuma16_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i* d = reinterpret_cast<__m128i*>(dest + i * 2);
+        __m128i a, b, c, y, u, v;
+
+        Load3x16(src + i * 3, a, b, c);
+        Deinterleave3x16_SSSE3(a, b, c, y, u, v);
+        _mm_storeu_si128(d,     _mm_unpacklo_epi8(zero, y));
+        _mm_storeu_si128(d + 1, _mm_unpackhi_epi8(zero, y));
+    }
+
+    Yuv444ToLuma16_Scalar(dest + i * 2, src + i * 3, pixelCount - i);
+}
+
+ConvertFunc SelectYuv444ToLuma16(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return Yuv444ToLuma16_SSSE3;
+    return Yuv444ToLuma16_Scalar;
+}
+
+void Yuv444ToGreen8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; i++, src += 3)
+        dest[i] = ClampByte(src[0] - ((YUV_Q14_GU * (src[1] - 128) + YUV_Q14_GV * (src[2] - 128) + YUV_Q14_ROUND) >> 14));
+}
+
+NIKONKS_TARGET_SSSE3 void Yuv444ToGreen8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    size_t i = 0;
+
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i a, b, c, y, u, v;
+
+        Load3x16(src + i * 3, a, b, c);
+        Deinterleave3x16_SSSE3(a, b, c, y, u, v);
+
+        __m128i glo = Yuv444ToG16_SSSE3(_mm_unpacklo_epi8(y, zero), _mm_sub_epi16(_mm_unpacklo_epi8(u, zero), bias),
+                                        _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias));
+        __m128i ghi = Yuv444ToG16_SSSE3(_mm_unpackhi_epi8(y, zero), _mm_sub_epi16(_mm_unpackhi_epi8(u, zero), bias),
+                                        _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packus_epi16(glo, ghi));
+    }
+
+    Yuv444ToGreen8_Scalar(dest + i, src + i * 3, pixelCount - i);
+}
+
+ConvertFunc SelectYuv444ToGreen8(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return Yuv444ToGreen8_SSSE3;
+    return Yuv444ToGreen8_Scalar;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Mono16
+///////////////////////////////////////////////////////////////////////////////
+
+void CopyMono16(unsigned char* dest, const unsigned char* src, size_t pixelCount)
+{
+    memcpy(dest, src, pixelCount * 2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Binning
+///////////////////////////////////////////////////////////////////////////////
+
+void BinMono16_Scalar(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean)
+{
+    unsigned short* d = reinterpret_cast<unsigned short*>(dest);
+    unsigned count = factor * factor;
+
+    for (size_t i = 0; i < destPixels; i++)
+    {
+        unsigned sum = 0;
+        for (unsigned r = 0; r < factor; r++)
+        {
+            const unsigned short* s = reinterpret_cast<const unsigned short*>(src + r * srcRowBytes) + i * factor;
+            for (unsigned c = 0; c < factor; c++)
+                sum += s[c];
+        }
+        if (mean)
+            sum = (sum + count / 2) / count;
+        d[i] = (unsigned short)(sum > 65535 ? 65535 : sum);
+    }
+}
+
+/* 8 output pixels per iteration. pmaddwd only multiplies signed words, so the pixels are
+   flipped to signed (-32768) first and every horizontal pair sum comes out 65536 short. */
+NIKONKS_TARGET_SSSE3 void BinMono16_SSSE3(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean)
+{
+    if (factor != 2 && factor != 4)
+    {
+        BinMono16_Scalar(dest, src, srcRowBytes, destPixels, factor, mean);
+        return;
+    }
+
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i half = _mm_set1_epi32(32768);
+    const __m128i unbias = _mm_set1_epi32((int)(factor * factor / 2 * 65536 + (mean ? factor * factor / 2 : 0)));
+    const __m128i shift = _mm_cvtsi32_si128(mean ? (factor == 2 ? 2 : 4) : 0);
+    size_t i = 0;
+
+    for (; i + 8 <= destPixels; i += 8)
+    {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+
+        for (unsigned r = 0; r < factor; r++)
+        {
+            const __m128i* s = reinterpret_cast<const __m128i*>(src + r * srcRowBytes + i * factor * 2);
+            __m128i p0 = _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128(s), flip), ones);
+            __m128i p1 = _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128(s + 1), flip), ones);
+            if (factor == 2)
+            {
+                lo = _mm_add_epi32(lo, p0);
+                hi = _mm_add_epi32(hi, p1);
+            }
+            else
+            {
+                __m128i p2 = _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128(s + 2), flip), ones);
+                __m128i p3 = _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128(s + 3), flip), ones);
+                lo = _mm_add_epi32(lo, _mm_hadd_epi32(p0, p1));
+                hi = _mm_add_epi32(hi, _mm_hadd_epi32(p2, p3));
+            }
+        }
+        lo = _mm_srl_epi32(_mm_add_epi32(lo, unbias), shift);
+        hi = _mm_srl_epi32(_mm_add_epi32(hi, unbias), shift);
+
+        /* No unsigned dword pack before SSE4.1, saturate through the signed one instead */
+        __m128i out = _mm_packs_epi32(_mm_sub_epi32(lo, half), _mm_sub_epi32(hi, half));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 2), _mm_xor_si128(out, flip));
+    }
+
+    BinMono16_Scalar(dest + i * 2, src + i * factor * 2, srcRowBytes, destPixels - i, factor, mean);
+}
+
+BinFunc SelectBinMono16(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return BinMono16_SSSE3;
+    return BinMono16_Scalar;
+}
+
+void BinMono8_Scalar(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean)
+{
+    unsigned count = factor * factor;
+
+    for (size_t i = 0; i < destPixels; i++)
+    {
+        unsigned sum = 0;
+        for (unsigned r = 0; r < factor; r++)
+        {
+            const unsigned char* s = src + r * srcRowBytes + i * factor;
+            for (unsigned c = 0; c < factor; c++)
+                sum += s[c];
+        }
+        if (mean)
+            sum = (sum + count / 2) / count;
+        dest[i] = ClampByte((int)sum);
+    }
+}
+
+/* 8 output pixels per iteration, pmaddubsw with ones adds horizontal pairs into 16 bit lanes */
+NIKONKS_TARGET_SSSE3 void BinMono8_SSSE3(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean)
+{
+    if (factor != 2 && factor != 4)
+    {
+        BinMono8_Scalar(dest, src, srcRowBytes, destPixels, factor, mean);
+        return;
+    }
+
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i round = _mm_set1_epi16((short)(mean ? factor * factor / 2 : 0));
+    const __m128i shift = _mm_cvtsi32_si128(mean ? (factor == 2 ? 2 : 4) : 0);
+    size_t i = 0;
+
+    for (; i + 8 <= destPixels; i += 8)
+    {
+        __m128i acc = _mm_setzero_si128();
+
+        for (unsigned r = 0; r < factor; r++)
+        {
+            const __m128i* s = reinterpret_cast<const __m128i*>(src + r * srcRowBytes + i * factor);
+            __m128i p0 = _mm_maddubs_epi16(_mm_loadu_si128(s), ones);
+            if (factor == 2)
+                acc = _mm_add_epi16(acc, p0);
+            else
+                acc = _mm_add_epi16(acc, _mm_hadd_epi16(p0, _mm_maddubs_epi16(_mm_loadu_si128(s + 1), ones)));
+        }
+        acc = _mm_srl_epi16(_mm_add_epi16(acc, round), shift);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + i), _mm_packus_epi16(acc, acc));
+    }
+
+    BinMono8_Scalar(dest + i, src + i * factor, srcRowBytes, destPixels - i, factor, mean);
+}
+
+BinFunc SelectBinMono8(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return BinMono8_SSSE3;
+    return BinMono8_Scalar;
+}
+
+void BinBGRA8_Scalar(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean)
+{
+    unsigned count = factor * factor;
+
+    for (size_t i = 0; i < destPixels; i++)
+    {
+        unsigned sum[4] = {0, 0, 0, 0};
+        for (unsigned r = 0; r < factor; r++)
+        {
+            const unsigned char* s = src + r * srcRowBytes + i * factor * 4;
+            for (unsigned c = 0; c < factor * 4; c++)
+                sum[c & 3] += s[c];
+        }
+        for (unsigned k = 0; k < 4; k++)
+        {
+            if (mean)
+                sum[k] = (sum[k] + count / 2) / count;
+            dest[i * 4 + k] = ClampByte((int)sum[k]);
+        }
+    }
+}
+
+/* 4 output pixels per iteration. Channels are summed in 16 bit lanes (at most 16 * 255),
+   each accumulator ends with two pixels that are folded into one by adding its halves. */
+NIKONKS_TARGET_SSSE3 void BinBGRA8_SSSE3(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean)
+{
+    if (factor != 2 && factor != 4)
+    {
+        BinBGRA8_Scalar(dest, src, srcRowBytes, destPixels, factor, mean);
+        return;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16((short)(mean ? factor * factor / 2 : 0));
+    const __m128i shift = _mm_cvtsi32_si128(mean ? (factor == 2 ? 2 : 4) : 0);
+    size_t i = 0;
+
+    for (; i + 4 <= destPixels; i += 4)
+    {
+        __m128i acc[4] = {zero, zero, zero, zero};
+
+        for (unsigned r = 0; r < factor; r++)
+        {
+            const unsigned char* s = src + r * srcRowBytes + i * factor * 4;
+            for (unsigned k = 0; k < 4; k++)
+            {
+                if (factor == 2)
+                {
+                    __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + k * 8));
+                    acc[k] = _mm_add_epi16(acc[k], _mm_unpacklo_epi8(v, zero));
+                }
+                else
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + k * 16));
+                    acc[k] = _mm_add_epi16(acc[k], _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)));
+                }
+            }
+        }
+        for (unsigned k = 0; k < 4; k++)
+            acc[k] = _mm_add_epi16(acc[k], _mm_srli_si128(acc[k], 8));
+
+        __m128i a = _mm_srl_epi16(_mm_add_epi16(_mm_unpacklo_epi64(acc[0], acc[1]), round), shift);
+        __m128i b = _mm_srl_epi16(_mm_add_epi16(_mm_unpacklo_epi64(acc[2], acc[3]), round), shift);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), _mm_packus_epi16(a, b));
+    }
+
+    BinBGRA8_Scalar(dest + i * 4, src + i * factor * 4, srcRowBytes, destPixels - i, factor, mean);
+}
+
+BinFunc SelectBinBGRA8(ECpuSimdLevel level)
+{
+    if (level >= ecslSSSE3)
+        return BinBGRA8_SSSE3;
+    return BinBGRA8_Scalar;
+}
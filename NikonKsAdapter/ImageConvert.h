@@ -0,0 +1,94 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ImageConvert.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pixel conversion kernels for the NikonKsCam adapter
+//                (scalar reference versions plus SSSE3/AVX2 versions
+//                selected at runtime by CPU feature detection)
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_IMAGECONVERT_H_
+#define _NIKONKS_IMAGECONVERT_H_
+
+#include <cstddef>
+
+/* AVX2 intrinsics need VS2012 or newer */
+#if !defined(NIKONKS_NO_AVX2) && (!defined(_MSC_VER) || (_MSC_VER >= 1700))
+#define NIKONKS_HAVE_AVX2
+#endif
+
+enum ECpuSimdLevel
+{
+	ecslScalar	= 0,
+	ecslSSSE3	= 1,
+	ecslAVX2	= 2,
+};
+
+/* Converts pixelCount packed source pixels into dest. Source and destination may be unaligned. */
+typedef void (*ConvertFunc)(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+
+/* Reduces each factor x factor block of pixels to one. src points at the first of factor rows
+   srcRowBytes apart, destPixels blocks are read from them. mean averages, otherwise the sum
+   saturates at the largest pixel value. */
+typedef void (*BinFunc)(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean);
+
+/* Highest instruction set usable on this CPU (and enabled by the OS for AVX) */
+ECpuSimdLevel GetCpuSimdLevel();
+const char* GetCpuSimdLevelName(ECpuSimdLevel level);
+
+/* BGR24 -> BGRA32 with alpha = 0 */
+void Bgr8ToBGRA8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+void Bgr8ToBGRA8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+#ifdef NIKONKS_HAVE_AVX2
+void Bgr8ToBGRA8_AVX2(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+#endif
+ConvertFunc SelectBgr8ToBGRA8(ECpuSimdLevel level);
+
+/* YUV444 (Y, Cb, Cr byte order, full range) -> BGRA32 with alpha = 0.
+   BT.601 coefficients in Q14 fixed point, see ImageConvert.cpp */
+void Yuv444ToBGRA8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+void Yuv444ToBGRA8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+ConvertFunc SelectYuv444ToBGRA8(ECpuSimdLevel level);
+
+/* Color -> one plane: BT.601 luma scaled to 16 bits, or the 8 bit green channel */
+void Bgr8ToLuma16_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+void Bgr8ToLuma16_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+ConvertFunc SelectBgr8ToLuma16(ECpuSimdLevel level);
+void Bgr8ToGreen8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+void Bgr8ToGreen8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+ConvertFunc SelectBgr8ToGreen8(ECpuSimdLevel level);
+void Yuv444ToLuma16_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+void Yuv444ToLuma16_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+ConvertFunc SelectYuv444ToLuma16(ECpuSimdLevel level);
+void Yuv444ToGreen8_Scalar(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+void Yuv444ToGreen8_SSSE3(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+ConvertFunc SelectYuv444ToGreen8(ECpuSimdLevel level);
+
+/* Mono16 -> Mono16 straight copy */
+void CopyMono16(unsigned char* dest, const unsigned char* src, size_t pixelCount);
+
+/* Software binning, the SSSE3 versions handle factors 2 and 4 and fall back to scalar otherwise */
+void BinMono16_Scalar(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean);
+void BinMono16_SSSE3(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean);
+BinFunc SelectBinMono16(ECpuSimdLevel level);
+void BinMono8_Scalar(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean);
+void BinMono8_SSSE3(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean);
+BinFunc SelectBinMono8(ECpuSimdLevel level);
+void BinBGRA8_Scalar(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean);
+void BinBGRA8_SSSE3(unsigned char* dest, const unsigned char* src, size_t srcRowBytes, size_t destPixels, unsigned factor, bool mean);
+BinFunc SelectBinBGRA8(ECpuSimdLevel level);
+
+#endif //_NIKONKS_IMAGECONVERT_H_
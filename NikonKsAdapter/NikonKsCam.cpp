@@ -22,16 +22,57 @@
 
 #include "NikonKsCam.h"
 #include "ModuleInterface.h"
+#include <algorithm>
 #include <cstdio>
+#include <iomanip>
 #include <string>
 #include <sstream>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
 #define KSCAM_BUFFER_NUM       5
+#define KSCAM_BUFFER_NUM_MAX   128
+#define KSCAM_BUFFER_NUM_MIN   2
+#define KSCAM_BUFFER_TARGET_MS 1000
+#define KSCAM_FRAME_SLOTS      2
+#define KSCAM_QUEUE_DEPTH      4
+#define KSCAM_QUEUE_DEPTH_MAX  64
+#define KSCAM_QUEUE_EMPTY      1
+#define KSCAM_RECEIVED_TICKS_MASK  (KSCAM_RECEIVED_TICKS - 1)
+#define KSCAM_EVENT_RING_DEPTH 256
 
 using namespace std;
 
+/* Read-only statistics properties, the index is passed to OnStatsCounter / OnStatsLatency */
+static const struct
+{
+    const char* name;
+    EAcqCounter counter;
+} g_StatsCounters[] =
+{
+    { "Frames Received",    eacReceived },
+    { "Frames Grabbed",     eacGrabbed },
+    { "Frames Inserted",    eacInserted },
+    { "Dropped Frames",     eacDropped },
+    { "Frame Timeouts",     eacTimeouts },
+    { "Events Lost",        eacEventsLost },
+};
+
+static const struct
+{
+    const char* name;
+    EAcqLatency latency;
+    double percentile;
+} g_StatsLatencies[] =
+{
+    { "Grab Latency p50 (ms)",      ealGrab,    50.0 },
+    { "Grab Latency p99 (ms)",      ealGrab,    99.0 },
+    { "Insert Latency p50 (ms)",    ealInsert,  50.0 },
+    { "Insert Latency p99 (ms)",    ealInsert,  99.0 },
+    { "Wakeup Latency p50 (ms)",    ealWakeup,  50.0 },
+    { "Wakeup Latency p99 (ms)",    ealWakeup,  99.0 },
+};
+
 // External names used used by the rest of the system
 const char* g_CameraDeviceName = "NikonKsCam";
 
@@ -44,6 +85,38 @@ const char* g_MeteringAreaLeft = "Metering Area Left";
 const char* g_MeteringAreaTop = "Metering Area Top";
 const char* g_MeteringAreaWidth = "Metering Area Width";
 const char* g_MeteringAreaHeight = "Metering Area Height";
+const char* g_SimdLevel = "Conversion SIMD Level";
+const char* g_ConvertThreads = "Conversion Threads";
+const char* g_QueueDepth = "Pipeline Queue Depth";
+const char* g_QueueLevel = "Pipeline Queue Level";
+const char* g_QueuePeak = "Pipeline Queue Peak";
+const char* g_GrabStageBusy = "Pipeline Grab Stage Busy %";
+const char* g_InsertStageBusy = "Pipeline Insert Stage Busy %";
+const char* g_FrameDropless = "Frame Dropless";
+const char* g_StatsFile = "Stats File";
+const char* g_StatsInterval = "Stats Interval (ms)";
+const char* g_BufferMode = "Driver Buffer Mode";
+const char* g_BufferCount = "Driver Buffer Count";
+const char* g_BuffersAllocated = "Driver Buffers Allocated";
+const char* g_WarmSnap = "Warm Snap";
+const char* g_SnapLatency = "Snap Latency (ms)";
+const char* g_SequenceTrigger = "Sequence Trigger";
+const char* g_SequenceFreeRun = "Free Run";
+const char* g_SequenceSoftBurst = "Soft Burst";
+const char* g_FeatureBatch = "Feature Batch";
+const char* g_FeatureBatchBegin = "Begin";
+const char* g_FeatureBatchCommit = "Commit";
+const char* g_BatchCommitTime = "Feature Batch Commit (ms)";
+const char* g_InitTime = "Init Time Breakdown";
+const char* g_DescCache = "Descriptor Cache";
+const char* g_FrameInterval = "Frame Interval (ms)";
+const char* g_BinningMode = "Binning Mode";
+const char* g_BinningMean = "Mean";
+const char* g_BinningSum = "Sum";
+const char* g_OutputMode = "Output Mode";
+const char* g_OutputBGRA = "BGRA";
+const char* g_OutputLuminance16 = "Luminance16";
+const char* g_OutputGreen = "Green only";
 
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
@@ -93,43 +166,53 @@ FCAM_EventCallback EventCallback(const lx_uint32 eventCameraHandle,
 /* Camera event callback function handler */
 void NikonKsCam::DoEvent(const lx_uint32 eventCameraHandle, CAM_Event* pEvent, void* pTransData)
 {
-    lx_uint32 result = LX_OK;
-    std::ostringstream os;
-    char strWork[CAM_FEA_COMMENT_MAX];
-
     if ( eventCameraHandle != this->cameraHandle_ )
     {
         LogMessage("DoEvent Error, Invalid Camera Handle \n");
         return;
     }
-    switch(pEvent->eEventType)
+
+    /* Frame notifications are on the latency critical path: no allocation, no logging here.
+       The event thread logs and counts them from the ring. */
+    if (pEvent->eEventType == ecetImageReceived)
     {
-    case    ecetImageReceived:
-        os << "ImageRecieved Frameno=" << pEvent->stImageReceived.uiFrameNo << " uiRemain= " << pEvent->stImageReceived.uiRemained << endl;
-        LogMessage(os.str().c_str());
+        KsEventRecord record;
+        record.eEventType = ecetImageReceived;
+        record.tick = StatsNow();
+        record.uiFrameNo = pEvent->stImageReceived.uiFrameNo;
+        record.uiRemained = pEvent->stImageReceived.uiRemained;
+
+        /* Remember when each frame arrived, the grab and insert stages measure their latency from here */
+        receivedTicks_[record.uiFrameNo & KSCAM_RECEIVED_TICKS_MASK] = record.tick;
+        /* Later callbacks keep the first tick, the wakeup latency is measured from the signal that woke the wait */
+        InterlockedCompareExchange64(&signalTick_, record.tick, 0);
         /* Signal frameDoneEvent_ so we know an image has been recieved */
         frameDoneEvent_.Set();
-        break;
+
+        if (eventRing_.Push(record))
+            eventThd_->wake_.Set();
+        else
+            stats_.Increment(eacEventsLost);
+        return;
+    }
+
+    lx_uint32 result = LX_OK;
+    std::ostringstream os;
+    const char* strWork;
+
+    switch(pEvent->eEventType)
+    {
     case    ecetFeatureChanged:
-        strcpy(strWork, ConvFeatureIdToName(pEvent->stFeatureChanged.uiFeatureId));
+        strWork = FeatureIdToName(pEvent->stFeatureChanged.uiFeatureId);
         os << "Feature Changed Callback: " << strWork << endl;
         LogMessage(os.str().c_str());
         /* Update vectFeatureValue_ to have the new stVariant */
-        vectFeatureValue_.pstFeatureValue[mapFeatureIndex_[pEvent->stFeatureChanged.uiFeatureId]].stVariant
+        vectFeatureValue_.pstFeatureValue[featureIndex_[pEvent->stFeatureChanged.uiFeatureId]].stVariant
             = pEvent->stFeatureChanged.stVariant;
-        /* Update FeatureDesc because it may have changed */
-        result = CAM_GetFeatureDesc(cameraHandle_, pEvent->stFeatureChanged.uiFeatureId,
-                                    featureDesc_[mapFeatureIndex_[pEvent->stFeatureChanged.uiFeatureId]]);
-        if (result != LX_OK) {
-            LogMessage("Error updating featuredesc after callback");
-        }
-        switch (pEvent->stFeatureChanged.uiFeatureId) {
-        case eExposureTime:
-            UpdateProperty((char*)MM::g_Keyword_Exposure);
-            break;
-        default:
-            UpdateProperty(strWork);
-        }
+        /* FeatureDesc may have changed, it is fetched again on next use */
+        InvalidateFeatureDesc(pEvent->stFeatureChanged.uiFeatureId);
+        MarkFeatureChanged(pEvent->stFeatureChanged.uiFeatureId);
+        UpdateFeatureProperties(pEvent->stFeatureChanged.uiFeatureId);
         break;
     case    ecetExposureEnd:
         break;
@@ -189,19 +272,67 @@ NikonKsCam::NikonKsCam() :
     roiY_(0),
     roiWidth_(0),
     roiHeight_(0),
+    roiActive_(false),
     binSize_(1),
+    swBin_(1),
+    binMean_(true),
+    outputMode_(eomBGRA),
+    snapFrame_(NULL),
     readoutUs_(0.0),
     framesPerSecond_(0.0),
     cameraBuf_(nullptr),
-    cameraBufId_(0)
+    cameraBufId_(0),
+    queueDepth_(KSCAM_QUEUE_DEPTH),
+    queuePeak_(0),
+    grabBusyUs_(0.0),
+    insertBusyUs_(0.0),
+    frameDropless_(false),
+    framesRemained_(0),
+    lastFrameNo_(0),
+    statsIntervalMs_(1000),
+    signalTick_(0),
+    bufferAuto_(true),
+    bufferCount_(KSCAM_BUFFER_NUM),
+    buffersAllocated_(0),
+    warmSnap_(false),
+    transferArmed_(false),
+    snapLatencyMs_(0.0),
+    softBurst_(false),
+    burstRemaining_(0),
+    exposureSequenceable_(false),
+    exposureSequenceRunning_(false),
+    exposureModeBeforeSequence_(ecemManual),
+    exposureSequenceMaxUs_(0),
+    featureBatch_(false),
+    batchCommitMs_(0.0),
+    descFetchMs_(0.0),
+    descFetched_(0),
+    descCached_(0),
+    descPrefetching_(false),
+    descCacheHit_(false),
+    formatsStale_(true),
+    staleEffects_(efeTiming),
+    simdLevel_(ecslScalar)
 {
     // call the base class method to set-up default error codes/messages
     InitializeDefaultErrorMessages();
     readoutStartTime_ = GetCurrentMMTime();
     thd_ = new MySequenceThread(this);
-
-    /*Initialize image data buffer*/
-    image_.pDataBuffer = new BYTE[(4908 * (3264 + 1) * 3)];
+    insertThd_ = new MyInsertThread(this);
+    eventThd_ = new MyEventThread(this);
+    prefetchThd_ = new MyPrefetchThread(this);
+    statsMonitor_ = new StatsMonitorThread(&stats_);
+    memset((void*)receivedTicks_, 0, sizeof(receivedTicks_));
+
+    /* Pick the fastest conversion kernels this CPU supports, the format table uses them */
+    simdLevel_ = GetCpuSimdLevel();
+    memset(&format_, 0, sizeof(format_));
+    format_.convert = CopyMono16;
+
+    /* Conversion is memory bound, more than a few threads rarely helps */
+    SYSTEM_INFO sysInfo;
+    GetSystemInfo(&sysInfo);
+    convertThreads_ = sysInfo.dwNumberOfProcessors < 4 ? sysInfo.dwNumberOfProcessors : 4;
 
     // Create a pre-initialization property and list all the available cameras
     // Demo cameras will be included in the list
@@ -261,6 +392,10 @@ NikonKsCam::~NikonKsCam()
 {
     StopSequenceAcquisition();
     delete thd_;
+    delete insertThd_;
+    delete eventThd_;
+    delete prefetchThd_;
+    delete statsMonitor_;
 }
 
 /**
@@ -296,8 +431,12 @@ int NikonKsCam::Initialize()
     CAM_Device* ptrDeviceTemp;
     lx_uint32 i;
     lx_wchar szError[CAM_ERRMSG_MAX];
+    CPropertyAction* pAct;
     string camID_string = camID_;
     ostringstream os;
+    MM::MMTime startInit = GetCurrentMMTime();
+    MM::MMTime stepStart = startInit;
+    double openDevicesMs, openMs, featuresMs;
 
 
     /* Rescan device list */
@@ -306,6 +445,7 @@ int NikonKsCam::Initialize()
     {
         LogMessage("Error calling CAM_OpenDevices().");
     }
+    openDevicesMs = (GetCurrentMMTime() - stepStart).getMsec();
 
     os << "Opening Camera: " << camID_ << endl;
     LogMessage(os.str().c_str());
@@ -325,7 +465,9 @@ int NikonKsCam::Initialize()
     ZeroMemory(szError, sizeof(szError));
 
     /* Open the camera using the deviceIndex number */
+    stepStart = GetCurrentMMTime();
     result = CAM_Open(deviceIndex_, cameraHandle_, (sizeof(szError) / sizeof((szError)[0])), szError);
+    openMs = (GetCurrentMMTime() - stepStart).getMsec();
     if (result != LX_OK)
     {
         os << "Error calling CAM_Open():" << szError << " DeviceIndex: " << deviceIndex_ << endl;
@@ -338,6 +480,7 @@ int NikonKsCam::Initialize()
     this->isOpened_ = TRUE;
 
     /* Setup callback function for event notification and handling */
+    eventRing_.Reset(KSCAM_EVENT_RING_DEPTH);
     result = CAM_SetEventCallback(cameraHandle_, reinterpret_cast<FCAM_EventCallback>(EventCallback),
                                   ptrEventData_);
     if (result != LX_OK)
@@ -345,15 +488,26 @@ int NikonKsCam::Initialize()
         LogMessage("Error calling CAM_SetEventCallback().");
         throw DEVICE_ERR ;
     }
+    /* Started after the last throw, so a failed Initialize leaves no thread behind.
+       Records the callback queues before this are drained on the first pass. */
+    eventThd_->Start();
 
     /* Needed to setup callback access */
     g_pDlg = this;
 
-    /* Get all feature values and descriptions */
+    /* Descriptors depend only on the camera, its firmware and the SDK, reuse them from the last start */
+    OpenDescCache();
+
+    /* Get all feature values, descriptions are fetched when a property first needs them */
+    stepStart = GetCurrentMMTime();
     GetAllFeatures();
+    featuresMs = (GetCurrentMMTime() - stepStart).getMsec();
 
     GetAllFeaturesDesc();
 
+    /* Format table and image buffer first, the ROI and metering area limits come from the active format */
+    UpdateImageSettings();
+
     /* Ri2 has additional features, check if camera is Ri2 */
     switch (device_.eCamDeviceType)
     {
@@ -392,16 +546,117 @@ int NikonKsCam::Initialize()
     nRet |= CreateProperty("USB Version", strWork, MM::String, true);
     wcstombs(strWork, reinterpret_cast<wchar_t const*>(device_.wszDriverVersion), CAM_VERSION_MAX);
     nRet |= CreateProperty("Driver Version", strWork, MM::String, true);
+    nRet |= CreateProperty(g_SimdLevel, GetCpuSimdLevelName(simdLevel_), MM::String, true);
+    assert(nRet == DEVICE_OK);
+
+    //Number of threads used to convert each frame
+    convertPool_.SetThreadCount(convertThreads_);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnConvertThreads);
+    nRet = CreateProperty(g_ConvertThreads, CDeviceUtils::ConvertToString((long)convertThreads_), MM::Integer, false, pAct);
+    nRet |= SetPropertyLimits(g_ConvertThreads, 1, CONVERT_THREADS_MAX);
+    assert(nRet == DEVICE_OK);
+
+    //Sequence pipeline (grab stage -> queue -> insert stage)
+    pAct = new CPropertyAction(this, &NikonKsCam::OnQueueDepth);
+    nRet = CreateProperty(g_QueueDepth, CDeviceUtils::ConvertToString((long)queueDepth_), MM::Integer, false, pAct);
+    nRet |= SetPropertyLimits(g_QueueDepth, 1, KSCAM_QUEUE_DEPTH_MAX);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnQueueLevel);
+    nRet |= CreateProperty(g_QueueLevel, "0", MM::Integer, true, pAct);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnQueuePeak);
+    nRet |= CreateProperty(g_QueuePeak, "0", MM::Integer, true, pAct);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnGrabStageBusy);
+    nRet |= CreateProperty(g_GrabStageBusy, "0", MM::Float, true, pAct);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnInsertStageBusy);
+    nRet |= CreateProperty(g_InsertStageBusy, "0", MM::Float, true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    //Frame dropless: drain every frame buffered by the driver instead of only taking the newest one
+    pAct = new CPropertyAction(this, &NikonKsCam::OnFrameDropless);
+    nRet = CreateProperty(g_FrameDropless, "OFF", MM::String, false, pAct);
+    nRet |= AddAllowedValue(g_FrameDropless, "OFF");
+    nRet |= AddAllowedValue(g_FrameDropless, "ON");
+    assert(nRet == DEVICE_OK);
+
+    //Acquisition statistics, counters and latencies cover the current/last sequence
+    for (long i = 0; i < (long)(sizeof(g_StatsCounters) / sizeof(g_StatsCounters[0])); i++)
+    {
+        CPropertyActionEx* pActEx = new CPropertyActionEx(this, &NikonKsCam::OnStatsCounter, i);
+        nRet |= CreateProperty(g_StatsCounters[i].name, "0", MM::Integer, true, pActEx);
+    }
+    for (long i = 0; i < (long)(sizeof(g_StatsLatencies) / sizeof(g_StatsLatencies[0])); i++)
+    {
+        CPropertyActionEx* pActEx = new CPropertyActionEx(this, &NikonKsCam::OnStatsLatency, i);
+        nRet |= CreateProperty(g_StatsLatencies[i].name, "0", MM::Float, true, pActEx);
+    }
+    //Snapshot of the statistics rewritten every interval, no file is written while empty
+    pAct = new CPropertyAction(this, &NikonKsCam::OnStatsFile);
+    nRet |= CreateProperty(g_StatsFile, "", MM::String, false, pAct);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnStatsInterval);
+    nRet |= CreateProperty(g_StatsInterval, CDeviceUtils::ConvertToString(statsIntervalMs_), MM::Integer, false, pAct);
+    nRet |= SetPropertyLimits(g_StatsInterval, 100, 60000);
+    assert(nRet == DEVICE_OK);
+
+    //Number of frame buffers the driver allocates when frame transfer starts
+    pAct = new CPropertyAction(this, &NikonKsCam::OnBufferMode);
+    nRet = CreateProperty(g_BufferMode, "Auto", MM::String, false, pAct);
+    nRet |= AddAllowedValue(g_BufferMode, "Auto");
+    nRet |= AddAllowedValue(g_BufferMode, "Manual");
+    pAct = new CPropertyAction(this, &NikonKsCam::OnBufferCount);
+    nRet |= CreateProperty(g_BufferCount, CDeviceUtils::ConvertToString((long)bufferCount_), MM::Integer, false, pAct);
+    nRet |= SetPropertyLimits(g_BufferCount, 1, KSCAM_BUFFER_NUM_MAX);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnBuffersAllocated);
+    nRet |= CreateProperty(g_BuffersAllocated, "0", MM::Integer, true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    //Warm snap: keep frame transfer started between snaps in Soft trigger mode
+    pAct = new CPropertyAction(this, &NikonKsCam::OnWarmSnap);
+    nRet = CreateProperty(g_WarmSnap, "OFF", MM::String, false, pAct);
+    nRet |= AddAllowedValue(g_WarmSnap, "OFF");
+    nRet |= AddAllowedValue(g_WarmSnap, "ON");
+    pAct = new CPropertyAction(this, &NikonKsCam::OnSnapLatency);
+    nRet |= CreateProperty(g_SnapLatency, "0", MM::Float, true, pAct);
+    assert(nRet == DEVICE_OK);
+
+    //Sequence trigger: free running, or one soft trigger per burst of "Trigger Frame Count" frames
+    pAct = new CPropertyAction(this, &NikonKsCam::OnSequenceTrigger);
+    nRet = CreateProperty(g_SequenceTrigger, g_SequenceFreeRun, MM::String, false, pAct);
+    nRet |= AddAllowedValue(g_SequenceTrigger, g_SequenceFreeRun);
+    nRet |= AddAllowedValue(g_SequenceTrigger, g_SequenceSoftBurst);
+    assert(nRet == DEVICE_OK);
+
+    //Feature batch: "Begin" collects feature writes, "Commit" sends them in one CAM_SetFeatures call
+    pAct = new CPropertyAction(this, &NikonKsCam::OnFeatureBatch);
+    nRet = CreateProperty(g_FeatureBatch, g_FeatureBatchCommit, MM::String, false, pAct);
+    nRet |= AddAllowedValue(g_FeatureBatch, g_FeatureBatchBegin);
+    nRet |= AddAllowedValue(g_FeatureBatch, g_FeatureBatchCommit);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnBatchCommitTime);
+    nRet |= CreateProperty(g_BatchCommitTime, "0", MM::Float, true, pAct);
     assert(nRet == DEVICE_OK);
 
 
-    //Binning is handled by the Image Format setting and this camera only allows hardware bin 3
-    nRet |= CreateProperty(MM::g_Keyword_Binning, "1", MM::Integer, false);
+    //Binning 3 is the sensor's 1/3 average format, 2 and 4 are binned in software
+    pAct = new CPropertyAction(this, &NikonKsCam::OnBinning);
+    nRet |= CreateProperty(MM::g_Keyword_Binning, CDeviceUtils::ConvertToString(binSize_), MM::Integer, false, pAct);
     nRet |= AddAllowedValue(MM::g_Keyword_Binning, "1");
+    nRet |= AddAllowedValue(MM::g_Keyword_Binning, "2");
+    nRet |= AddAllowedValue(MM::g_Keyword_Binning, "3");
+    nRet |= AddAllowedValue(MM::g_Keyword_Binning, "4");
+    pAct = new CPropertyAction(this, &NikonKsCam::OnBinningMode);
+    nRet |= CreateProperty(g_BinningMode, g_BinningMean, MM::String, false, pAct);
+    nRet |= AddAllowedValue(g_BinningMode, g_BinningMean);
+    nRet |= AddAllowedValue(g_BinningMode, g_BinningSum);
+    assert(nRet == DEVICE_OK);
+
+    //Color formats can be reduced to one plane while converting, Mono16 formats ignore this
+    pAct = new CPropertyAction(this, &NikonKsCam::OnOutputMode);
+    nRet = CreateProperty(g_OutputMode, g_OutputBGRA, MM::String, false, pAct);
+    nRet |= AddAllowedValue(g_OutputMode, g_OutputBGRA);
+    nRet |= AddAllowedValue(g_OutputMode, g_OutputLuminance16);
+    nRet |= AddAllowedValue(g_OutputMode, g_OutputGreen);
     assert(nRet == DEVICE_OK);
 
     //Exposure
-    auto* pAct = new CPropertyAction(this, &NikonKsCam::OnExposureTime);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnExposureTime);
     nRet = CreateKsProperty(eExposureTime, pAct);
     assert(nRet == DEVICE_OK);
 
@@ -455,7 +710,7 @@ int NikonKsCam::Initialize()
     }
 
     //ROI Position (range is subject to change depending on format!)
-    auto* featureDesc = &featureDesc_[mapFeatureIndex_[eRoiPosition]];
+    auto* featureDesc = LoadFeatureDesc(eRoiPosition);
     pAct = new CPropertyAction(this, &NikonKsCam::OnRoiX);
     nRet = CreateProperty(g_RoiPositionX, "", MM::Integer, false, pAct);
     assert(nRet == DEVICE_OK);
@@ -466,7 +721,7 @@ int NikonKsCam::Initialize()
     SetROILimits();
 
     //Trigger Options
-    featureDesc = &featureDesc_[mapFeatureIndex_[eTriggerOption]];
+    featureDesc = LoadFeatureDesc(eTriggerOption);
     pAct = new CPropertyAction(this, &NikonKsCam::OnTriggerFrame);
     nRet = CreateProperty(g_TriggerFrameCt, "", MM::Integer, false, pAct);
     nRet |= SetPropertyLimits(g_TriggerFrameCt, featureDesc->stTriggerOption.stRangeFrameCount.stMin.ui32Value, featureDesc->stTriggerOption.stRangeFrameCount.stMax.ui32Value);
@@ -513,6 +768,17 @@ int NikonKsCam::Initialize()
     nRet = CreateKsProperty(eExposureMode, pAct);
     assert(nRet == DEVICE_OK);
 
+    //Exposure sequences run on the MultiExposureTime feature, if the camera offers that exposure mode
+    if (featureIndex_.Has(eMultiExposureTime))
+    {
+        featureDesc = LoadFeatureDesc(eExposureMode);
+        for (lx_uint32 i = 0; i < featureDesc->uiListCount; i++)
+        {
+            if (featureDesc->stElementList[i].varValue.ui32Value == ecemMultiExposureTime)
+                exposureSequenceable_ = true;
+        }
+    }
+
     //Exposure Bias
     pAct = new CPropertyAction(this, &NikonKsCam::OnExposureBias);
     nRet = CreateKsProperty(eExposureBias, pAct);
@@ -538,10 +804,6 @@ int NikonKsCam::Initialize()
     nRet = CreateKsProperty(eExposureOutput, pAct);
     assert(nRet == DEVICE_OK);
 
-    // setup the buffer
-    // ----------------
-    UpdateImageSettings();
-
     // synchronize all properties
     // --------------------------
     nRet = DEVICE_OK;
@@ -549,6 +811,25 @@ int NikonKsCam::Initialize()
     if (nRet != DEVICE_OK)
         return nRet;
 
+    /* Where the time went, descriptors no property asked for are left to the prefetch thread */
+    os.str("");
+    os << std::fixed << std::setprecision(1)
+       << "CAM_OpenDevices " << openDevicesMs << " ms, CAM_Open " << openMs
+       << " ms, Features " << featuresMs << " ms, Descriptors " << descFetchMs_
+       << " ms (" << descFetched_ << " of " << vectFeatureValue_.uiCountUsed
+       << ", " << descCached_ << " from cache), Total " << (GetCurrentMMTime() - startInit).getMsec() << " ms";
+    LogMessage(("Initialize: " + os.str()).c_str());
+    nRet = CreateProperty(g_InitTime, os.str().c_str(), MM::String, true);
+    nRet |= CreateProperty(g_DescCache, descCacheHit_ ? "Hit" : "Miss", MM::String, true);
+    pAct = new CPropertyAction(this, &NikonKsCam::OnFrameInterval);
+    nRet |= CreateProperty(g_FrameInterval, "0", MM::Float, true, pAct);
+    assert(nRet == DEVICE_OK);
+    {
+        MMThreadGuard g(descLock_);
+        descPrefetching_ = true;
+    }
+    prefetchThd_->Start();
+
     isInitialized_ = true;
 
     return DEVICE_OK;
@@ -557,18 +838,18 @@ int NikonKsCam::Initialize()
 /* Create MM Property for a given FeatureId */
 int NikonKsCam::CreateKsProperty(lx_uint32 FeatureId, CPropertyAction *pAct)
 {
-    auto    featureIndex = mapFeatureIndex_[FeatureId];
+    auto    featureIndex = featureIndex_[FeatureId];
     auto*	featureValue = &vectFeatureValue_.pstFeatureValue[featureIndex];
-    auto*   featureDesc = &featureDesc_[featureIndex];
-    char	strWork[50];
+    auto*   featureDesc = LoadFeatureDesc(FeatureId);
+    string	label;
     const char*	strTitle;
     auto nRet = DEVICE_OK;
 
 
     /* strTitle is readable name of feature */
-    strTitle = ConvFeatureIdToName(featureValue->uiFeatureId);
+    strTitle = FeatureIdToName(featureValue->uiFeatureId);
 
-    switch (featureDesc_[featureIndex].eFeatureDescType) {
+    switch (featureDesc->eFeatureDescType) {
     case edesc_Range:
         switch (featureValue->stVariant.eVarType) {
         case	evrt_int32:
@@ -610,18 +891,18 @@ int NikonKsCam::CreateKsProperty(lx_uint32 FeatureId, CPropertyAction *pAct)
         nRet |= CreateProperty(strTitle, "", MM::String, false, pAct);
         for (auto Index = 0; Index < featureDesc->uiListCount; Index++)
         {
-            wcstombs(strWork, reinterpret_cast<wchar_t const*>(featureDesc->stElementList[Index].wszComment), CAM_FEA_COMMENT_MAX);
+            featureLabels_.Label(*featureDesc, Index, label);
             /* OnePushAE is not allowed to be set by User */
-            if (strcmp(strWork, "OnePushAE") != 0)
-                nRet |= AddAllowedValue(strTitle, strWork);
+            if (label.compare("OnePushAE") != 0)
+                nRet |= AddAllowedValue(strTitle, label.c_str());
         }
         break;
     case edesc_FormatList:
         nRet |= CreateProperty(strTitle, "", MM::String, false, pAct);
         for (auto formatIndex = 0; formatIndex < featureDesc->uiListCount; formatIndex++)
         {
-            wcstombs(strWork, reinterpret_cast<wchar_t const*>(featureDesc->stFormatList[formatIndex].wszComment), CAM_FEA_COMMENT_MAX);
-            nRet |= AddAllowedValue(strTitle, strWork);
+            featureLabels_.Label(*featureDesc, formatIndex, label);
+            nRet |= AddAllowedValue(strTitle, label.c_str());
         }
         break;
     case edesc_unknown:
@@ -637,23 +918,6 @@ int NikonKsCam::CreateKsProperty(lx_uint32 FeatureId, CPropertyAction *pAct)
     return nRet;
 }
 
-/* convert FeatureId to readable name */
-const char* NikonKsCam::ConvFeatureIdToName(const lx_uint32 featureId)
-{
-    lx_uint32       i;
-    auto* featureName= new char[30];
-
-    for (i = 0;; i++)
-    {
-        if (stFeatureNameRef[i].uiFeatureId ==  eUnknown || stFeatureNameRef[i].uiFeatureId == featureId)
-        {
-            break;
-        }
-    }
-    wcstombs(featureName, (wchar_t const *)stFeatureNameRef[i].wszName, 30);
-    return featureName;
-}
-
 /* This function populates vectFeatureValue_ with all features */
 void NikonKsCam::GetAllFeatures()
 {
@@ -686,12 +950,21 @@ void NikonKsCam::GetAllFeatures()
     return;
 }
 
-/* This function creates the feature map and calls featureChanged for every feature. populates all featureDesc_ */
+/* This function creates the feature map and allocates featureDesc_. Descriptors are fetched by LoadFeatureDesc() */
 void NikonKsCam::GetAllFeaturesDesc()
 {
     lx_uint32   uiFeatureId, i;
 
-    mapFeatureIndex_.clear();
+    featureIndex_.Clear();
+    featureLabels_.Clear();
+
+    MMThreadGuard g(descLock_);
+    descLoaded_.assign(vectFeatureValue_.uiCountUsed, false);
+    descStale_.assign(vectFeatureValue_.uiCountUsed, false);
+    descDeferred_.assign(vectFeatureValue_.uiCountUsed, false);
+    descFetchMs_ = 0.0;
+    descFetched_ = 0;
+    formatsStale_ = true;
 
     featureDesc_ = new CAM_FeatureDesc[vectFeatureValue_.uiCountUsed];
     if ( !featureDesc_ )
@@ -705,67 +978,353 @@ void NikonKsCam::GetAllFeaturesDesc()
     {
         uiFeatureId = vectFeatureValue_.pstFeatureValue[i].uiFeatureId;
         /* map the FeatureId to i */
-        mapFeatureIndex_.insert(std::make_pair(uiFeatureId, i));
-        auto result = CAM_GetFeatureDesc(cameraHandle_, uiFeatureId, featureDesc_[i]);
+        featureIndex_.Set(uiFeatureId, i);
+    }
+}
+
+/* Returns the descriptor of uiFeatureId, fetching it from the camera on first use. The record is only
+   fetched again after InvalidateFeatureDesc(), never while the prefetch thread is running. */
+CAM_FeatureDesc* NikonKsCam::LoadFeatureDesc(lx_uint32 uiFeatureId)
+{
+    lx_uint32 index = featureIndex_[uiFeatureId];
+
+    MMThreadGuard g(descLock_);
+    if (index < descLoaded_.size() && !descLoaded_[index])
+    {
+        MM::MMTime startFetch = GetCurrentMMTime();
+        /* Descriptors invalidated since Initialize have changed on the camera, the cache is stale for them */
+        if (!descStale_[index] && !DescCache::IsLive(uiFeatureId) && descCache_.Lookup(uiFeatureId, featureDesc_[index]))
+        {
+            descLoaded_[index] = true;
+            descFetched_++;
+            descCached_++;
+            descFetchMs_ += (GetCurrentMMTime() - startFetch).getMsec();
+            return &featureDesc_[index];
+        }
+        auto result = CAM_GetFeatureDesc(cameraHandle_, uiFeatureId, featureDesc_[index]);
         if (result != LX_OK)
         {
             LogMessage("CAM_GetFeatureDesc Error");
+        }
+        else
+        {
+            descLoaded_[index] = true;
+            descFetched_++;
+        }
+        descFetchMs_ += (GetCurrentMMTime() - startFetch).getMsec();
+    }
+    return &featureDesc_[index];
+}
+
+bool NikonKsCam::IsFeatureDescLoaded(lx_uint32 uiFeatureId)
+{
+    lx_uint32 index = featureIndex_[uiFeatureId];
+
+    MMThreadGuard g(descLock_);
+    return index < descLoaded_.size() && descLoaded_[index];
+}
+
+/* The next LoadFeatureDesc() fetches the descriptor again. LoadFeatureDesc() hands out pointers into featureDesc_
+   and a fetch rewrites the record in place, so while the prefetch thread is still loading (and would be a second
+   writer next to the MM and callback threads) the invalidation is only recorded and EndDescPrefetch() applies it. */
+void NikonKsCam::InvalidateFeatureDesc(lx_uint32 uiFeatureId)
+{
+    lx_uint32 index = featureIndex_[uiFeatureId];
+
+    {
+        MMThreadGuard g(descLock_);
+        if (index >= descLoaded_.size() || !descLoaded_[index])
+            return;
+        descStale_[index] = true;
+        if (descPrefetching_)
+        {
+            descDeferred_[index] = true;
+            return;
+        }
+        descLoaded_[index] = false;
+        descFetched_--;
+    }
+    featureLabels_.Invalidate(uiFeatureId);
+    if (uiFeatureId == eFormat)
+        formatsStale_ = true;
+}
+
+/* Called by the prefetch thread when it stops loading, applies the invalidations it held back.
+   Shutdown stops the prefetch thread with updateProperties false. */
+void NikonKsCam::EndDescPrefetch(bool updateProperties)
+{
+    std::vector<lx_uint32> featureIds;
+    {
+        MMThreadGuard g(descLock_);
+        descPrefetching_ = false;
+        for (lx_uint32 i = 0; i < descDeferred_.size(); i++)
+        {
+            if (descDeferred_[i])
+            {
+                descDeferred_[i] = false;
+                featureIds.push_back(vectFeatureValue_.pstFeatureValue[i].uiFeatureId);
+            }
+        }
+    }
+    for (size_t i = 0; i < featureIds.size(); i++)
+    {
+        InvalidateFeatureDesc(featureIds[i]);
+        /* The properties were refreshed from the old descriptor when the change was reported */
+        if (updateProperties)
+            UpdateFeatureProperties(featureIds[i]);
+    }
+}
+
+/* Cache file of this camera in the temp directory, keyed by serial, FW, FPGA and SDK version */
+void NikonKsCam::OpenDescCache()
+{
+    CAM_CMD_GetSdkVersion sdkVersion;
+    char tempDir[MAX_PATH];
+    std::ostringstream os;
+
+    memset(&descCacheKey_, 0, sizeof(descCacheKey_));
+    memset(&sdkVersion, 0, sizeof(sdkVersion));
+    descCacheKey_.uiSerialNo = device_.uiSerialNo;
+    memcpy(descCacheKey_.wszFwVersion, device_.wszFwVersion, sizeof(descCacheKey_.wszFwVersion));
+    memcpy(descCacheKey_.wszFpgaVersion, device_.wszFpgaVersion, sizeof(descCacheKey_.wszFpgaVersion));
+    if (CAM_Command(cameraHandle_, CAM_CMD_GET_SDKVERSION, &sdkVersion) != LX_OK)
+    {
+        /* Without the SDK version a cache could outlive an SDK update */
+        LogMessage("CAM_CMD_GET_SDKVERSION error, descriptor cache disabled");
+        descCachePath_.clear();
+        descCacheHit_ = false;
+        return;
+    }
+    memcpy(descCacheKey_.wszSdkVersion, sdkVersion.wszSdkVersion, sizeof(descCacheKey_.wszSdkVersion));
+
+    if (GetTempPathA(MAX_PATH, tempDir) == 0)
+        tempDir[0] = '\0';
+    os << tempDir << "NikonKsDescCache_" << device_.uiSerialNo << ".bin";
+    descCachePath_ = os.str();
+
+    MMThreadGuard g(descLock_);
+    descCacheHit_ = descCache_.Open(descCachePath_, descCacheKey_);
+    LogMessage((std::string(descCacheHit_ ? "Descriptor cache hit: " : "Descriptor cache miss: ") + descCachePath_).c_str());
+}
+
+/* Called by the prefetch thread once every descriptor is loaded. A miss writes the cache for the next start,
+   a hit has nothing more to read from the mapping. */
+void NikonKsCam::FinishDescCache()
+{
+    std::vector<const CAM_FeatureDesc*> descs;
+    {
+        MMThreadGuard g(descLock_);
+
+        if (descCacheHit_ || descCachePath_.empty())
+        {
+            descCache_.Close();
             return;
         }
+        /* Only the record addresses are taken under the lock, a stale descriptor is not worth caching */
+        for (lx_uint32 i = 0; i < descLoaded_.size(); i++)
+        {
+            if (descLoaded_[i] && !descStale_[i] && !DescCache::IsLive(featureDesc_[i].uiFeatureId))
+                descs.push_back(&featureDesc_[i]);
+        }
     }
+    if (descs.empty())
+        return;
+    /* The file is written without descLock_, property handlers keep reading descriptors meanwhile */
+    if (!DescCache::Write(descCachePath_, descCacheKey_, &descs[0], (lx_uint32)descs.size()))
+        LogMessage(("Error writing descriptor cache " + descCachePath_).c_str());
 }
 
 /* This function calls SetFeature for a given uiFeatureId */
-void NikonKsCam::SetFeature(lx_uint32 uiFeatureId)
+lx_result NikonKsCam::SetFeature(lx_uint32 uiFeatureId)
 {
     auto result = LX_OK;
-    lx_uint32                   index;
     Vector_CAM_FeatureValue     vectFeatureValue;
+    CAM_FeatureValue            featureValue;
+
+    /* Inside a batch the value stays in vectFeatureValue_ until CommitFeatureBatch() */
+    if (featureBatch_)
+    {
+        if (std::find(batchFeatureIds_.begin(), batchFeatureIds_.end(), uiFeatureId) == batchFeatureIds_.end())
+            batchFeatureIds_.push_back(uiFeatureId);
+        return LX_OK;
+    }
 
     /* Prepare the vectFeatureValue structure to use in the CAM_setFeatures command */
+    featureValue = vectFeatureValue_.pstFeatureValue[featureIndex_[uiFeatureId]];
     vectFeatureValue.uiCountUsed = 1;
     vectFeatureValue.uiCapacity = 1;
     vectFeatureValue.uiPauseTransfer = 0;
-    vectFeatureValue.pstFeatureValue = new CAM_FeatureValue[1];
-    if (vectFeatureValue.pstFeatureValue == nullptr)
-    {
-        LogMessage("Error allocating memory vecFeatureValue.");
-        return;
-    }
-
-    index = mapFeatureIndex_[uiFeatureId];
-    vectFeatureValue.pstFeatureValue[0] = vectFeatureValue_.pstFeatureValue[index];
+    vectFeatureValue.pstFeatureValue = &featureValue;
 
     result = CAM_SetFeatures(cameraHandle_, vectFeatureValue);
-    Free_Vector_CAM_FeatureValue(vectFeatureValue);
     if (result != LX_OK)
     {
         LogMessage("CAM_SetFeatures Error");
-        GetAllFeatures();
-        return;
+        ResyncFeatures(&uiFeatureId, 1);
+        UpdateDerivedState(efeGeometry);
+        return result;
     }
 
     LogMessage("SetFeature() Success");
-    return;
+    MarkFeatureChanged(uiFeatureId);
+    UpdateDerivedState(efeGeometry);
+    return result;
 }
 
-/* This function calls CAM_Command */
-void NikonKsCam::Command(const lx_wchar* wszCommand)
+/* Starts collecting feature writes. Nothing is sent to the camera until CommitFeatureBatch() */
+void NikonKsCam::BeginFeatureBatch()
+{
+    featureBatch_ = true;
+}
+
+/* Sends every feature written since BeginFeatureBatch() in as few CAM_SetFeatures calls as the SDK
+   allows (CAM_FEA_CAPACITY features each), with frame transfer paused once per call instead of once per feature */
+lx_result NikonKsCam::CommitFeatureBatch()
 {
     auto result = LX_OK;
+    Vector_CAM_FeatureValue         vectFeatureValue;
+    std::vector<CAM_FeatureValue>   values;
+    size_t committed = 0;
+
+    featureBatch_ = false;
+    if (batchFeatureIds_.empty())
+        return LX_OK;
+
+    MM::MMTime startCommit = GetCurrentMMTime();
+    /* The format goes first, ROI position and metering area are only valid for the new format */
+    std::vector<lx_uint32>::iterator format = std::find(batchFeatureIds_.begin(), batchFeatureIds_.end(), (lx_uint32)eFormat);
+    if (format != batchFeatureIds_.end())
+    {
+        batchFeatureIds_.erase(format);
+        batchFeatureIds_.insert(batchFeatureIds_.begin(), eFormat);
+    }
+    for (size_t i = 0; i < batchFeatureIds_.size(); i++)
+        values.push_back(vectFeatureValue_.pstFeatureValue[featureIndex_[batchFeatureIds_[i]]]);
+    batchFeatureIds_.clear();
+
+    /* Chunks go out in order, so the format is always in the first one */
+    vectFeatureValue.uiPauseTransfer = 1;
+    while (committed < values.size())
+    {
+        auto count = (lx_uint32)(std::min)(values.size() - committed, (size_t)CAM_FEA_CAPACITY);
+        vectFeatureValue.uiCountUsed = count;
+        vectFeatureValue.uiCapacity = count;
+        vectFeatureValue.pstFeatureValue = &values[committed];
+        result = CAM_SetFeatures(cameraHandle_, vectFeatureValue);
+        if (result != LX_OK)
+            break;
+        committed += count;
+    }
 
-    if (!_wcsicmp(reinterpret_cast<wchar_t const *>(wszCommand), CAM_CMD_START_FRAMETRANSFER))
+    for (size_t i = 0; i < committed; i++)
+        MarkFeatureChanged(values[i].uiFeatureId);
+    if (result != LX_OK)
     {
-        CAM_CMD_StartFrameTransfer      stCmd;
+        LogMessage("CAM_SetFeatures Error (feature batch)");
+        /* The failed chunk and everything after it were never applied, or only partly */
+        std::vector<lx_uint32> featureIds;
+        for (size_t i = committed; i < values.size(); i++)
+            featureIds.push_back(values[i].uiFeatureId);
+        ResyncFeatures(&featureIds[0], featureIds.size());
+    }
+    /* The handlers ran before the camera had the new values */
+    UpdateDerivedState(efeGeometry);
+    batchCommitMs_ = (GetCurrentMMTime() - startCommit).getMsec();
 
-        /* Start frame transfer */
-        stCmd.uiImageBufferNum = KSCAM_BUFFER_NUM;
-        result = CAM_Command(cameraHandle_, CAM_CMD_START_FRAMETRANSFER, &stCmd);
+    std::ostringstream os;
+    os << "Feature batch of " << values.size() << " features committed in " << batchCommitMs_ << " ms";
+    LogMessage(os.str().c_str());
+    return result;
+}
+
+/* Rereads featureIds and their dependents with CAM_GetFeatures (SDK memory, no CCU reload).
+   Values are copied into vectFeatureValue_ in place, so the array is never reallocated,
+   and only properties whose value differs from the cached one are updated. */
+void NikonKsCam::ResyncFeatures(const lx_uint32* featureIds, size_t count)
+{
+    Vector_CAM_FeatureValue         vectFeatureValue;
+    std::vector<CAM_FeatureValue>   values;
+    bool requested[KSCAM_FEATURE_ID_COUNT] = {false};
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const lx_uint32* dependents = FeatureDependents(featureIds[i]);
+        for (lx_uint32 featureId = featureIds[i]; featureId != eUnknown; featureId = *dependents++)
+        {
+            if (!featureIndex_.Has(featureId) || requested[featureId])
+                continue;
+            requested[featureId] = true;
+            values.push_back(CAM_FeatureValue());
+            values.back().uiFeatureId = featureId;
+        }
+    }
+    if (values.empty())
+        return;
+
+    /* Dependents can take the list past what one CAM_GetFeatures call accepts */
+    for (size_t first = 0; first < values.size(); first += CAM_FEA_CAPACITY)
+    {
+        auto count = (lx_uint32)(std::min)(values.size() - first, (size_t)CAM_FEA_CAPACITY);
+        vectFeatureValue.uiCountUsed = count;
+        vectFeatureValue.uiCapacity = count;
+        vectFeatureValue.pstFeatureValue = &values[first];
+        auto result = CAM_GetFeatures(cameraHandle_, vectFeatureValue);
         if (result != LX_OK)
         {
-            LogMessage("CAM_Command start frame transfer error");
+            LogMessage("CAM_GetFeatures Error");
             return;
         }
+
+        for (lx_uint32 i = 0; i < vectFeatureValue.uiCountUsed; i++)
+        {
+            CAM_FeatureValue& value = vectFeatureValue.pstFeatureValue[i];
+            CAM_FeatureValue* featureValue = &vectFeatureValue_.pstFeatureValue[featureIndex_[value.uiFeatureId]];
+            if (featureValue->stVariant.eVarType == value.stVariant.eVarType &&
+                featureValue->stVariant == value.stVariant)
+                continue;
+            featureValue->stVariant = value.stVariant;
+            MarkFeatureChanged(value.uiFeatureId);
+            UpdateFeatureProperties(value.uiFeatureId);
+        }
+    }
+}
+
+/* Refreshes the MM properties that show featureId */
+void NikonKsCam::UpdateFeatureProperties(lx_uint32 featureId)
+{
+    switch (featureId) {
+    case eExposureTime:
+        UpdateProperty(MM::g_Keyword_Exposure);
+        break;
+    case eRoiPosition:
+        UpdateProperty(g_RoiPositionX);
+        UpdateProperty(g_RoiPositionY);
+        break;
+    case eMeteringArea:
+        UpdateProperty(g_MeteringAreaLeft);
+        UpdateProperty(g_MeteringAreaTop);
+        UpdateProperty(g_MeteringAreaWidth);
+        UpdateProperty(g_MeteringAreaHeight);
+        break;
+    case eTriggerOption:
+        UpdateProperty(g_TriggerFrameCt);
+        UpdateProperty(g_TriggerFrameDelay);
+        break;
+    default:
+        if (HasProperty(FeatureIdToName(featureId)))
+            UpdateProperty(FeatureIdToName(featureId));
+    }
+}
+
+/* This function calls CAM_Command */
+lx_result NikonKsCam::Command(const lx_wchar* wszCommand)
+{
+    lx_result result = LX_OK;
+
+    if (!_wcsicmp(reinterpret_cast<wchar_t const *>(wszCommand), CAM_CMD_START_FRAMETRANSFER))
+    {
+        /* Snap, only a single frame is needed */
+        result = StartFrameTransfer(-1.0);
     }
     else
     {
@@ -773,142 +1332,231 @@ void NikonKsCam::Command(const lx_wchar* wszCommand)
         if (result != LX_OK)
         {
             LogMessage("CAM_Command error");
-            return;
         }
     }
-    return;
+    return result;
 }
 
-/* This should be called at initialization after features have been received, as well as whenever imgFormat is changed
-/* it should update the image buffer to have the proper width/height/depth as well as update relevant Properties */
-void NikonKsCam::UpdateImageSettings()
+/* Starts frame transfer with the manual driver buffer count, or in auto mode with
+   enough buffers for about KSCAM_BUFFER_TARGET_MS of frames at intervalMs (< 0 for a single frame) */
+lx_result NikonKsCam::StartFrameTransfer(double intervalMs)
 {
-    auto result = LX_OK;
+    CAM_CMD_StartFrameTransfer      stCmd;
+    lx_result                       result;
+
+    stCmd.uiImageBufferNum = bufferAuto_ ? AutoBufferCount(intervalMs) : bufferCount_;
+    auto requested = stCmd.uiImageBufferNum;
 
-    switch(vectFeatureValue_.pstFeatureValue[mapFeatureIndex_[eFormat]].stVariant.stFormat.eColor)
+    /* Start frame transfer */
+    result = CAM_Command(cameraHandle_, CAM_CMD_START_FRAMETRANSFER, &stCmd);
+    if (result == LX_ERR_OUTOFMEMORY && bufferAuto_ && stCmd.uiImageBufferNum > 0 && stCmd.uiImageBufferNum < requested)
     {
-    case ecfcUnknown:
-        LogMessage("Error: unknown image type.");
-        break;
-    case ecfcRgb24:
-        numComponents_ = 4;
-        byteDepth_ = 4;
-        bitDepth_ = 8;
-        color_ = true;
-        break;
-    case ecfcYuv444:
-        numComponents_ = 4;
-        byteDepth_ = 4;
-        bitDepth_ = 8;
-        color_ = true;
-        break;
-    case ecfcMono16:
-        numComponents_ = 1;
-        byteDepth_ = 2;
-        bitDepth_ = 16;
-        color_ = false;
-        break;
+        /* The driver returned how many buffers it can allocate, start again with that */
+        ostringstream os;
+        os << "Driver could only allocate " << stCmd.uiImageBufferNum << " of " << requested << " buffers, retrying";
+        LogMessage(os.str());
+        result = CAM_Command(cameraHandle_, CAM_CMD_START_FRAMETRANSFER, &stCmd);
     }
-
-    switch(vectFeatureValue_.pstFeatureValue[mapFeatureIndex_[eFormat]].stVariant.stFormat.eMode)
+    if (result != LX_OK)
     {
-    case ecfmUnknown:
-        LogMessage("Error: unknown image resolution.");
-        break;
-    case ecfm4908x3264:
-        imageWidth_=4908;
-        imageHeight_=3264;
-        break;
-    case ecfm2454x1632:
-        imageWidth_=2454;
-        imageHeight_=1632;
-        break;
-    case ecfm1636x1088:
-        imageWidth_=1636;
-        imageHeight_=1088;
-        break;
-    case ecfm818x544:
-        imageWidth_=818;
-        imageHeight_=544;
-        break;
-    case ecfm1608x1608:
-        imageWidth_=1608;
-        imageHeight_=1608;
-        break;
-    case ecfm804x804:
-        imageWidth_=804;
-        imageHeight_=804;
-        break;
-    case ecfm536x536:
-        imageWidth_=536;
-        imageHeight_=536;
-        break;
+        ostringstream os;
+        os << "CAM_Command start frame transfer error " << result;
+        if (result == LX_ERR_OUTOFMEMORY)
+            os << ", driver can allocate " << stCmd.uiImageBufferNum << " buffers";
+        LogMessage(os.str());
+        buffersAllocated_ = 0;
+        return result;
     }
+    buffersAllocated_ = stCmd.uiImageBufferNum;
+    return result;
+}
 
-    /* Update the buffer to have the proper width height and depth */
-    img_.Resize(imageWidth_, imageHeight_, byteDepth_);
+/* Driver buffer depth for auto mode: enough frames to cover KSCAM_BUFFER_TARGET_MS at the slower of
+   the exposure time and the frame interval, limited to an eighth of the free physical memory */
+lx_uint32 NikonKsCam::AutoBufferCount(double intervalMs)
+{
+    if (intervalMs < 0.0)
+        return KSCAM_BUFFER_NUM_MIN;
 
-    /* Update frameSize_ so we know how to size image_ in the GetImage() calls to driver*/
-    result = CAM_Command(cameraHandle_, CAM_CMD_GET_FRAMESIZE, &frameSize_);
-    if ( result != LX_OK )
+    double exposureMs = vectFeatureValue_.pstFeatureValue[featureIndex_[eExposureTime]].stVariant.ui32Value / 1000.0;
+    double frameMs = exposureMs > intervalMs ? exposureMs : intervalMs;
+    if (frameMs < FrameIntervalMs())
+        frameMs = FrameIntervalMs();
+    if (frameMs < 1.0)
+        frameMs = 1.0;
+
+    double count = KSCAM_BUFFER_TARGET_MS / frameMs;
+
+    MEMORYSTATUSEX memStatus;
+    memStatus.dwLength = sizeof(memStatus);
+    if (frameSize_.uiFrameSize > 0 && GlobalMemoryStatusEx(&memStatus))
     {
-        LogMessage("GetFrameSize Error.");
+        double memCount = (double)(memStatus.ullAvailPhys / 8) / frameSize_.uiFrameSize;
+        if (count > memCount)
+            count = memCount;
     }
 
+    if (count < KSCAM_BUFFER_NUM_MIN)
+        return KSCAM_BUFFER_NUM_MIN;
+    if (count > KSCAM_BUFFER_NUM_MAX)
+        return KSCAM_BUFFER_NUM_MAX;
+    return (lx_uint32)count;
 }
 
-/* Update ROI Property x and y limits */
-void NikonKsCam::SetROILimits()
+/* This should be called at initialization after features have been received, as well as whenever imgFormat is changed
+/* it should update the image buffer to have the proper width/height/depth as well as update relevant Properties.
+/* Everything comes from the format table, only the first switch to a format asks the camera for its frame size */
+void NikonKsCam::UpdateImageSettings()
 {
-    auto result = CAM_GetFeatureDesc(cameraHandle_, eRoiPosition,
-                                     featureDesc_[mapFeatureIndex_[eRoiPosition]]);
-    if (result != LX_OK)
+    /* The grab and insert stages are using format_ and the buffers, StopSequenceAcquisition() catches up */
+    if (insertThd_->IsRunning())
     {
-        LogMessage("CAM_GetFeatureDesc Error");
+        InterlockedOr(&staleEffects_, (LONG)efeGeometry);
         return;
     }
 
-    auto roiFeatureDesc = &featureDesc_[mapFeatureIndex_[eRoiPosition]];
+    if (formatsStale_)
+    {
+        formats_.Build(*LoadFeatureDesc(eFormat), simdLevel_);
+        formatsStale_ = false;
+    }
+
+    KsFormat* format = formats_.Find(vectFeatureValue_.pstFeatureValue[featureIndex_[eFormat]].stVariant.stFormat);
+    if (format == NULL)
+    {
+        LogMessage("Error: unknown image format.");
+        return;
+    }
 
-    /* If not in an ROI format setting (e.g. full frame), SDK will return min=max=1 */
-    /* which will cause an error in micromanager SetPropertyLimits() function */
-    /* for now just set min to 0 and max to 1 */
-    if (roiFeatureDesc->stPosition.stMin.uiX == roiFeatureDesc->stPosition.stMax.uiX)
+    /* Update frameSize_ so we know how to size the frame buffers in the GetImage() calls to driver.
+       The camera reports the size of the format it is running, which inside a feature batch may not
+       be this one yet: the size stays unknown and the commit brings the geometry up to date again. */
+    if (format->uiFrameSize == 0 && featureBatch_)
     {
-        SetPropertyLimits(g_RoiPositionX, 0, 1);
-        SetPropertyLimits(g_RoiPositionY, 0, 1);
+        InterlockedOr(&staleEffects_, (LONG)efeGeometry);
     }
-    else {
-        SetPropertyLimits(g_RoiPositionX, roiFeatureDesc->stPosition.stMin.uiX, roiFeatureDesc->stPosition.stMax.uiX);
-        SetPropertyLimits(g_RoiPositionY, roiFeatureDesc->stPosition.stMin.uiY, roiFeatureDesc->stPosition.stMax.uiY);
+    else if (format->uiFrameSize == 0)
+    {
+        CAM_CMD_GetFrameSize frameSize;
+        auto result = CAM_Command(cameraHandle_, CAM_CMD_GET_FRAMESIZE, &frameSize);
+        if ( result != LX_OK )
+        {
+            LogMessage("GetFrameSize Error.");
+            return;
+        }
+        format->uiFrameSize = frameSize.uiFrameSize;
+        frameSize_.uiFrameInterval = frameSize.uiFrameInterval;
     }
-    UpdateProperty(g_RoiPositionX);
-    UpdateProperty(g_RoiPositionY);
-}
+    frameSize_.uiFrameSize = format->uiFrameSize;
+    format_ = *format;
+    if (outputMode_ != eomBGRA)
+        SetOutputMode(format_, outputMode_, simdLevel_);
 
-/* Update Metering Area limits */
-void NikonKsCam::SetMeteringAreaLimits()
-{
-    auto result = CAM_GetFeatureDesc(cameraHandle_, eMeteringArea,	featureDesc_[mapFeatureIndex_[eMeteringArea]]);
-    if (result != LX_OK)
+    /* A format change SetROI() did not make ends the ROI */
+    if (roiActive_ && format_.stFormat != roiFormat_)
     {
-        LogMessage("CAM_GetFeatureDesc Error");
-        return;
+        LogMessage("Image format changed, ROI cleared.");
+        roiActive_ = false;
     }
-    auto featureDesc = &featureDesc_[mapFeatureIndex_[eMeteringArea]];
 
-    SetPropertyLimits(g_MeteringAreaLeft, featureDesc->stArea.stMin.uiLeft, featureDesc->stArea.stMax.uiLeft);
-    SetPropertyLimits(g_MeteringAreaTop, featureDesc->stArea.stMin.uiTop, featureDesc->stArea.stMax.uiTop);
-    SetPropertyLimits(g_MeteringAreaWidth, featureDesc->stArea.stMin.uiWidth, featureDesc->stArea.stMax.uiWidth);
-    SetPropertyLimits(g_MeteringAreaHeight, featureDesc->stArea.stMin.uiHeight, featureDesc->stArea.stMax.uiHeight);
+    /* Hardware and software binning do not stack */
+    if (format_.hwBin != 1 && swBin_ != 1)
+    {
+        LogMessage("Hardware binning format selected, software binning cleared.");
+        swBin_ = 1;
+    }
+    binSize_ = format_.hwBin * swBin_;
 
-    UpdateProperty(g_MeteringAreaLeft);
-    UpdateProperty(g_MeteringAreaTop);
-    UpdateProperty(g_MeteringAreaWidth);
-    UpdateProperty(g_MeteringAreaHeight);
+    numComponents_ = format_.numComponents;
+    byteDepth_ = format_.byteDepth;
+    bitDepth_ = format_.bitDepth;
+    color_ = format_.color;
+    imageWidth_ = (roiActive_ ? roiWidth_ : format_.uiWidth) / swBin_;
+    imageHeight_ = (roiActive_ ? roiHeight_ : format_.uiHeight) / swBin_;
+
+    /* Update the buffers to have the proper width height and depth, a snap not read yet no longer fits them */
+    ReleaseSnapFrame();
+    for (unsigned i = 0; i < 3; i++)
+        frames_.Slot(i).Resize(imageWidth_, imageHeight_, byteDepth_);
 }
 
-/**
+/* Records what featureId invalidates, callable from the callback thread */
+void NikonKsCam::MarkFeatureChanged(lx_uint32 featureId)
+{
+    unsigned effects = FeatureEffects(featureId);
+    if (effects != efeNone)
+        InterlockedOr(&staleEffects_, (LONG)effects);
+}
+
+/* Recomputes the parts of effects that went stale since they were last computed, nothing else */
+void NikonKsCam::UpdateDerivedState(unsigned effects)
+{
+    unsigned stale = (unsigned)InterlockedAnd(&staleEffects_, ~(LONG)effects) & effects;
+
+    if (stale & efeGeometry)
+        UpdateImageSettings();
+    if (stale & efeLimits)
+    {
+        SetROILimits();
+        SetMeteringAreaLimits();
+    }
+    if (stale & efeTiming)
+    {
+        CAM_CMD_GetFrameSize frameSize;
+        if (CAM_Command(cameraHandle_, CAM_CMD_GET_FRAMESIZE, &frameSize) == LX_OK)
+            frameSize_.uiFrameInterval = frameSize.uiFrameInterval;
+        else
+            LogMessage("GetFrameSize Error.");
+    }
+}
+
+/* Frame interval the camera reports for the current format and exposure, 0 if unknown */
+double NikonKsCam::FrameIntervalMs()
+{
+    UpdateDerivedState(efeTiming);
+    return frameSize_.uiFrameInterval / 1000.0;
+}
+
+/* Update ROI Property x and y limits */
+void NikonKsCam::SetROILimits()
+{
+    /* The range depends on the format, the format table has it */
+    auto format = &format_;
+
+    /* If not in an ROI format setting (e.g. full frame), SDK will return min=max=1 */
+    /* which will cause an error in micromanager SetPropertyLimits() function */
+    /* for now just set min to 0 and max to 1 */
+    if (format->stDescPosition.stMin.uiX == format->stDescPosition.stMax.uiX)
+    {
+        SetPropertyLimits(g_RoiPositionX, 0, 1);
+        SetPropertyLimits(g_RoiPositionY, 0, 1);
+    }
+    else {
+        SetPropertyLimits(g_RoiPositionX, format->stDescPosition.stMin.uiX, format->stDescPosition.stMax.uiX);
+        SetPropertyLimits(g_RoiPositionY, format->stDescPosition.stMin.uiY, format->stDescPosition.stMax.uiY);
+    }
+    UpdateProperty(g_RoiPositionX);
+    UpdateProperty(g_RoiPositionY);
+}
+
+/* Update Metering Area limits */
+void NikonKsCam::SetMeteringAreaLimits()
+{
+    /* The range depends on the format, the format table has it */
+    auto format = &format_;
+
+    SetPropertyLimits(g_MeteringAreaLeft, format->stDescArea.stMin.uiLeft, format->stDescArea.stMax.uiLeft);
+    SetPropertyLimits(g_MeteringAreaTop, format->stDescArea.stMin.uiTop, format->stDescArea.stMax.uiTop);
+    SetPropertyLimits(g_MeteringAreaWidth, format->stDescArea.stMin.uiWidth, format->stDescArea.stMax.uiWidth);
+    SetPropertyLimits(g_MeteringAreaHeight, format->stDescArea.stMin.uiHeight, format->stDescArea.stMax.uiHeight);
+
+    UpdateProperty(g_MeteringAreaLeft);
+    UpdateProperty(g_MeteringAreaTop);
+    UpdateProperty(g_MeteringAreaWidth);
+    UpdateProperty(g_MeteringAreaHeight);
+}
+
+/**
 * Shuts down (unloads) the device.
 * Required by the MM::Device API.
 * Ideally this method will completely unload the device and release all resources.
@@ -922,11 +1570,19 @@ int NikonKsCam::Shutdown()
 
     if ( this->isOpened_ )
     {
+        DisarmWarmSnap();
+        statsMonitor_->Stop();
+        prefetchThd_->Stop();
+        descCache_.Close();
+        featureBatch_ = false;
+        batchFeatureIds_.clear();
         result = CAM_Close(cameraHandle_);
         if ( result != LX_OK )
         {
             LogMessage("Error Closing Camera.");
         }
+        /* No more callbacks after CAM_Close */
+        eventThd_->Stop();
         Free_Vector_CAM_FeatureValue(vectFeatureValue_);
         if (featureDesc_ != NULL)
         {
@@ -939,6 +1595,9 @@ int NikonKsCam::Shutdown()
         this->isInitialized_ = FALSE;
         this->isRi2_ = FALSE;
         g_pDlg = nullptr;
+        convertPool_.SetThreadCount(1);
+        ReleaseSnapFrame();
+        framePool_.Clear();
     }
 
     return DEVICE_OK;
@@ -952,60 +1611,166 @@ int NikonKsCam::Shutdown()
 */
 int NikonKsCam::SnapImage()
 {
+    MM::MMTime startSnap = GetCurrentMMTime();
+    /* The insert stage owns the frames_ writer side until FinishPipeline() returns */
+    if (IsCapturing() || insertThd_->IsRunning())
+        return DEVICE_CAMERA_BUSY_ACQUIRING;
+    ReleaseSnapFrame();
+    //The frame has to reflect every feature written so far
+    if (featureBatch_ && CommitFeatureBatch() != LX_OK)
+        return DEVICE_ERR;
     //Determine exposureLength so we know a reasonable time to wait for frame arrival
-    auto exposureLength = vectFeatureValue_.pstFeatureValue[mapFeatureIndex_[eExposureTime]].stVariant.ui32Value / 1000;
+    UpdateDerivedState(efeGeometry);
+    auto exposureLength = vectFeatureValue_.pstFeatureValue[featureIndex_[eExposureTime]].stVariant.ui32Value / 1000;
+    auto frameInterval = (lx_uint32)FrameIntervalMs();
+    if (exposureLength < frameInterval)
+        exposureLength = frameInterval;
     char buf[MM::MaxStrLength];
     //Determine current trigger mode
-    GetProperty(ConvFeatureIdToName(eTriggerMode), buf);
+    GetProperty(FeatureIdToName(eTriggerMode), buf);
+    bool softTrigger = !strcmp(buf, "Soft");
 
-    Command(CAM_CMD_START_FRAMETRANSFER);
+    //Warm snap only applies to Soft trigger mode, otherwise the camera would stream between snaps
+    bool warm = warmSnap_ && softTrigger;
+    bool armed = warm && transferArmed_;
+    if (!armed)
+    {
+        if (Command(CAM_CMD_START_FRAMETRANSFER) != LX_OK)
+            return DEVICE_ERR;
+        transferArmed_ = warm;
+    }
+    else
+    {
+        //Transfer is already running, forget any stale frame signal
+        frameDoneEvent_.Reset();
+    }
     //If in soft trigger mode we need to send the signal to capture.
-    if (!strcmp(buf, "Soft"))
+    if (softTrigger)
         Command(CAM_CMD_ONEPUSH_SOFTTRIGGER);
     //Wait for frameDoneEvent from callback method
     // (time out after exposure length + 100 ms)
-    frameDoneEvent_.Wait(exposureLength + 100);
-    Command(CAM_CMD_STOP_FRAMETRANSFER);
-    GrabFrame();
+    int waitResult = frameDoneEvent_.Wait(exposureLength + 100);
+    if (!warm)
+        Command(CAM_CMD_STOP_FRAMETRANSFER);
+    if (waitResult != MM_WAIT_OK)
+    {
+        LogMessage(waitResult == MM_WAIT_TIMEOUT ? "SnapImage: timed out waiting for the frame." : "SnapImage: frame wait failed.");
+        return DEVICE_SNAP_IMAGE_FAILED;
+    }
+
+    /* The pool only changes size here and at sequence start, never under a running pipeline */
+    framePool_.Resize(frameSize_.uiFrameSize, KSCAM_FRAME_SLOTS);
+    auto frame = framePool_.Acquire();
+    if (frame == NULL)
+    {
+        LogMessage("SnapImage: no free frame buffer.");
+        return DEVICE_SNAP_IMAGE_FAILED;
+    }
+    /* Kept until GetImageBuffer() asks for it, Mono16 frames are never copied */
+    lx_uint32 uiRemained;
+    if (GrabFrame(frame, true, uiRemained, false) != LX_OK)
+    {
+        frame->Release();
+        return DEVICE_SNAP_IMAGE_FAILED;
+    }
+    snapFrame_ = frame;
 
+    snapLatencyMs_ = (GetCurrentMMTime() - startSnap).getMsec();
+    /* One line per snap, so cold and warm snaps can be compared from the log */
+    std::ostringstream os;
+    os << "SnapImage: " << (armed ? "warm" : "cold") << " snap in " << snapLatencyMs_ << " ms";
+    LogMessage(os.str().c_str(), true);
     return DEVICE_OK;
 }
 
-//Call after a frame is recieved to get the image from camera and copy to img_ buffer
-void NikonKsCam::GrabFrame()
+/* Stops a frame transfer left running by warm snap. Needed before the format
+   or trigger mode changes, a sequence starts or the camera is closed. */
+void NikonKsCam::DisarmWarmSnap()
 {
-    lx_result           result;
-    lx_uint32           uiRemained;
+    if (!transferArmed_)
+        return;
+
+    Command(CAM_CMD_STOP_FRAMETRANSFER);
+    transferArmed_ = false;
+}
 
-    /* Set image_ buffer to appropriate size */
-    image_.uiDataBufferSize = this->frameSize_.uiFrameSize;
+//Call after a frame is recieved to get the image from the camera into a frame buffer from framePool_
+//newest=false takes the oldest buffered frame, uiRemained returns how many are still buffered in the driver
+//mayBeEmpty: the caller woke on a signal that can be left over, a failure only means no frame was there
+lx_result NikonKsCam::GrabFrame(KsFrame* frame, bool newest, lx_uint32& uiRemained, bool mayBeEmpty)
+{
+    lx_result           result;
 
     /* Grab the Image */
-    result = CAM_GetImage(cameraHandle_, true, image_, uiRemained);
+    uiRemained = 0;
+    result = CAM_GetImage(cameraHandle_, newest, *frame, uiRemained);
     if (result != LX_OK)
     {
-        LogMessage("CAM_GetImage error.");
+        LogMessage(mayBeEmpty ? "CAM_GetImage: no frame behind the signal, waiting again." : "CAM_GetImage error.", mayBeEmpty);
     }
+    return result;
+}
 
-    if (color_)
-        Bgr8ToBGRA8(img_.GetPixelsRW(), (uint8_t*)image_.pDataBuffer, img_.Width(), img_.Height());
-    else
-        memcpy(img_.GetPixelsRW(), image_.pDataBuffer, img_.Width()*img_.Height()*img_.Depth());
+/* Pixels of frame exactly as MMCore wants them: Mono16 without software binning or a crop
+   inside the rows. NULL when the frame has to go through ConvertFrame() first. */
+const unsigned char* NikonKsCam::DirectPixels(const KsFrame* frame) const
+{
+    if (format_.stFormat.eColor != ecfcMono16 || swBin_ != 1)
+        return NULL;
+    if (roiActive_ && roiWidth_ != format_.uiWidth)
+        return NULL;
+    return frame->GetData() + (roiActive_ ? roiY_ * format_.srcRowBytes : 0);
+}
+
+void NikonKsCam::ReleaseSnapFrame()
+{
+    if (snapFrame_ == NULL)
+        return;
 
+    snapFrame_->Release();
+    snapFrame_ = NULL;
 }
 
-//copied from MM dc1394.cpp driver file
-//EF: converts bgr image to Micromanager BGRA
-// It is the callers responsibility that both src and destination exist
-void NikonKsCam::Bgr8ToBGRA8(unsigned char* dest, unsigned char* src, unsigned int width, unsigned int height)
+/* Converts (or copies) a frame from the driver layout into dest, split over the conversion threads */
+void NikonKsCam::ConvertFrame(unsigned char* dest, const unsigned char* src)
 {
-    for (register uint64_t i = 0, j = 0; i < (width * height * 3); i += 3, j += 4)
+    FrameConvertJob job;
+
+    job.dest = dest;
+    job.src = src;
+    job.width = imageWidth_;
+    job.destRowBytes = (size_t)imageWidth_ * byteDepth_;
+    job.srcRowBytes = format_.srcRowBytes;
+    job.convert = format_.convert;
+    job.contiguous = true;
+
+    if (roiActive_)
+    {
+        /* Software part of the ROI, skip the margin the hardware window leaves around it */
+        job.src += roiY_ * format_.srcRowBytes + (size_t)roiX_ * (format_.uiBitPerPixel / 8);
+        job.contiguous = false;
+    }
+
+    if (swBin_ > 1)
     {
-        dest[j] = src[i];
-        dest[j + 1] = src[i + 1];
-        dest[j + 2] = src[i + 2];
-        dest[j + 3] = 0;
+        FrameBinJob binJob;
+
+        binJob.dest = dest;
+        binJob.src = job.src;
+        binJob.width = job.width;
+        binJob.destRowBytes = job.destRowBytes;
+        binJob.srcRowBytes = job.srcRowBytes;
+        binJob.factor = swBin_;
+        binJob.bytesPerPixel = format_.byteDepth;
+        binJob.mean = binMean_;
+        binJob.convert = format_.stFormat.eColor != ecfcMono16 ? format_.convert : NULL;
+        binJob.bin = format_.bin;
+
+        convertPool_.Execute(binJob, imageHeight_, binJob.destRowBytes);
+        return;
     }
+
+    convertPool_.Execute(job, imageHeight_, job.destRowBytes);
 }
 
 /**
@@ -1018,9 +1783,23 @@ void NikonKsCam::Bgr8ToBGRA8(unsigned char* dest, unsigned char* src, unsigned i
 * the pixel buffer on its own. In other words, the buffer can change only if
 * appropriate properties are set (such as binning, pixel type, etc.)
 */
+/* The last snap is converted here, the first time it is asked for. Otherwise this is the newest
+   complete frame of the running sequence, which the insert stage never writes while it is handed out.
+   frames_ has one writer at a time: this thread for a snap, the insert stage during a sequence.
+   SnapImage() is refused while the pipeline runs and StartSequenceAcquisition() drops snapFrame_
+   before the insert stage starts, so the two never overlap. */
 const unsigned char* NikonKsCam::GetImageBuffer()
 {
-    auto pB = const_cast<unsigned char*>(img_.GetPixels());
+    if (snapFrame_ != NULL)
+    {
+        auto pixels = DirectPixels(snapFrame_);
+        if (pixels != NULL)
+            return pixels;
+        ConvertFrame(frames_.Write().GetPixelsRW(), snapFrame_->GetData());
+        frames_.Publish();
+        ReleaseSnapFrame();
+    }
+    auto pB = const_cast<unsigned char*>(frames_.Read().GetPixels());
     return pB;
 }
 
@@ -1038,24 +1817,72 @@ const unsigned char* NikonKsCam::GetImageBuffer()
 * @param xSize - width
 * @param ySize - height
 */
-/* KsCam only has fixed ROI settings which are handled by the format setting */
-int NikonKsCam::SetROI(unsigned /*x*/, unsigned /*y*/, unsigned /*xSize*/, unsigned /*ySize*/)
+/* KsCam only has fixed ROI formats (a window into the full frame at a given scale).
+   The smallest one that covers the request is placed with eRoiPosition and the rest is cropped
+   in ConvertFrame(), so only the window crosses USB. Coordinates are in full frame pixels. */
+int NikonKsCam::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
 {
-    return DEVICE_UNSUPPORTED_COMMAND;
+    if (IsCapturing())
+        return DEVICE_CAMERA_BUSY_ACQUIRING;
+    if (xSize == 0 || ySize == 0)
+        return ClearROI();
+
+    /* MMCore works in binned pixels, the crop is made in driver pixels */
+    x *= swBin_;
+    y *= swBin_;
+    xSize *= swBin_;
+    ySize *= swBin_;
+
+    CAM_Format fullFormat = format_.stFormat;
+    fullFormat.eMode = format_.eFullMode;
+    KsFormat* full = formats_.Find(fullFormat);
+    if (full == NULL)
+    {
+        LogMessage("SetROI: full frame format not available.");
+        return DEVICE_ERR;
+    }
+    if (x + xSize > full->uiWidth || y + ySize > full->uiHeight)
+        return DEVICE_INVALID_INPUT_PARAM;
+
+    std::vector<KsFormat*> covering;
+    formats_.FindCovering(fullFormat, xSize, ySize, covering);
+    for (size_t i = 0; i < covering.size(); i++)
+    {
+        CAM_Position position = {0, 0};
+        if (covering[i]->roi && !PlaceRoiWindow(*covering[i], x, y, xSize, ySize, position))
+            continue;
+
+        roiActive_ = true;
+        roiFormat_ = covering[i]->stFormat;
+        roiX_ = x - position.uiX;
+        roiY_ = y - position.uiY;
+        roiWidth_ = xSize;
+        roiHeight_ = ySize;
+        return ApplyROI(*covering[i], position);
+    }
+    return DEVICE_INVALID_INPUT_PARAM;
 }
 
 /**
 * Returns the actual dimensions of the current ROI.
 * Required by the MM::Camera API.
 */
-/* KsCam only has fixed ROI settings which are handled by the format setting */
+/* In full frame pixels, ROI formats chosen with the Image Format property count as an ROI too */
 int NikonKsCam::GetROI(unsigned& x, unsigned& y, unsigned& xSize, unsigned& ySize)
 {
-    x = roiX_;
-    y = roiY_;
+    x = roiActive_ ? roiX_ : 0;
+    y = roiActive_ ? roiY_ : 0;
+    if (format_.roi)
+    {
+        CAM_Position& position = vectFeatureValue_.pstFeatureValue[featureIndex_[eRoiPosition]].stVariant.stPosition;
+        x += position.uiX;
+        y += position.uiY;
+    }
+    x /= swBin_;
+    y /= swBin_;
 
-    xSize = img_.Width();
-    ySize = img_.Height();
+    xSize = imageWidth_;
+    ySize = imageHeight_;
 
     return DEVICE_OK;
 }
@@ -1066,12 +1893,59 @@ int NikonKsCam::GetROI(unsigned& x, unsigned& y, unsigned& xSize, unsigned& ySiz
 */
 int NikonKsCam::ClearROI()
 {
+    if (IsCapturing())
+        return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+    roiActive_ = false;
     roiX_ = 0;
     roiY_ = 0;
-    roiWidth_ = 4908; //true for both ri2 and qi2
-    roiHeight_ = 3264;
+    roiWidth_ = 0;
+    roiHeight_ = 0;
 
-    return DEVICE_OK;
+    CAM_Format fullFormat = format_.stFormat;
+    fullFormat.eMode = format_.eFullMode;
+    KsFormat* full = formats_.Find(fullFormat);
+    if (full == NULL)
+    {
+        LogMessage("ClearROI: full frame format not available.");
+        return DEVICE_ERR;
+    }
+    CAM_Position position = {0, 0};
+    return ApplyROI(*full, position);
+}
+
+/* Sends format (and the window position for ROI formats) in one batch, then sizes the image for
+   the crop in roiX_, roiY_, roiWidth_, roiHeight_, which changes even when the format does not */
+int NikonKsCam::ApplyROI(KsFormat& format, const CAM_Position& position)
+{
+    CAM_FeatureValue* formatValue = &vectFeatureValue_.pstFeatureValue[featureIndex_[eFormat]];
+    CAM_FeatureValue* positionValue = &vectFeatureValue_.pstFeatureValue[featureIndex_[eRoiPosition]];
+
+    /* Inside a batch the user opened, the writes join it and go out with the user's commit */
+    bool ownBatch = !featureBatch_;
+    if (ownBatch)
+        BeginFeatureBatch();
+    if (formatValue->stVariant.stFormat != format.stFormat)
+    {
+        //The driver buffers are sized for the old format
+        DisarmWarmSnap();
+        formatValue->stVariant.stFormat = format.stFormat;
+        SetFeature(eFormat);
+    }
+    if (format.roi)
+    {
+        positionValue->stVariant.stPosition = position;
+        SetFeature(eRoiPosition);
+    }
+    auto result = ownBatch ? CommitFeatureBatch() : LX_OK;
+    if (result != LX_OK)
+        roiActive_ = false;
+
+    UpdateImageSettings();
+    UpdateProperty(FeatureIdToName(eFormat));
+    UpdateProperty(g_RoiPositionX);
+    UpdateProperty(g_RoiPositionY);
+    return result == LX_OK ? DEVICE_OK : DEVICE_ERR;
 }
 
 /**
@@ -1102,7 +1976,7 @@ void NikonKsCam::SetExposure(double exp)
 */
 int NikonKsCam::GetBinning() const
 {
-    return DEVICE_OK;
+    return binSize_;
 }
 
 /**
@@ -1111,286 +1985,1151 @@ int NikonKsCam::GetBinning() const
 */
 int NikonKsCam::SetBinning(int binF)
 {
+    return SetProperty(MM::g_Keyword_Binning, CDeviceUtils::ConvertToString(binF));
+}
+
+int NikonKsCam::GetComponentName(unsigned comp, char* name)
+{
+    if (comp > 4)
+    {
+        name = "invalid comp";
+        return DEVICE_ERR;
+    }
+
+    std::string rgba("RGBA");
+    CDeviceUtils::CopyLimitedString(name, &rgba.at(comp));
+
+    return DEVICE_OK;
+}
+
+
+//Sequence functions, mostly copied from other drivers with slight modification
+/**
+ * Required by the MM::Camera API
+ * Please implement this yourself and do not rely on the base class implementation
+ * The Base class implementation is deprecated and will be removed shortly
+ */
+int NikonKsCam::StartSequenceAcquisition(double interval) {
+    return StartSequenceAcquisition(LONG_MAX, interval, false);
+}
+
+/**
+* Stop and wait for the Sequence thread finished
+*/
+int NikonKsCam::StopSequenceAcquisition()
+{
+    Command(CAM_CMD_STOP_FRAMETRANSFER);
+    if (!thd_->IsStopped()) {
+        thd_->Stop();
+        thd_->wait();
+    }
+    /* Also covers a sequence thread that already finished on its own */
+    FinishPipeline(true);
+    /* Format changes the camera reported during the sequence. Applied here and not in FinishPipeline(),
+       which also runs on the sequence thread while this thread may be reading the frame buffers */
+    UpdateDerivedState(efeGeometry);
+
+    return DEVICE_OK;
+}
+
+/**
+* Simple implementation of Sequence Acquisition
+* A sequence acquisition should run on its own thread and transport new images
+* coming of the camera into the MMCore circular buffer.
+*/
+int NikonKsCam::StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow)
+{
+    char triggerModeChar[CAM_FEA_COMMENT_MAX] = "OFF";
+    if (IsCapturing())
+        return DEVICE_CAMERA_BUSY_ACQUIRING;
+    /* The sequence needs its trigger mode on the camera, committing the user's batch for it would close it early */
+    if (featureBatch_)
+    {
+        LogMessage("Commit the feature batch before starting a sequence.");
+        return DEVICE_ERR;
+    }
+
+    auto ret = GetCoreCallback()->PrepareForAcq(this);
+    if (ret != DEVICE_OK)
+        return ret;
+    DisarmWarmSnap();
+    UpdateDerivedState(efeGeometry);
+    sequenceStartTime_ = GetCurrentMMTime();
+    imageCounter_ = 0;
+
+    /* Free run needs trigger mode OFF (as for "live view"), soft bursts need trigger mode Soft */
+    lx_uint32 sequenceTrigger = softBurst_ ? ectmSoft : ectmOff;
+    auto*   featureDesc = LoadFeatureDesc(eTriggerMode);
+    for (lx_uint32 i = 0; i < featureDesc->uiListCount; i++)
+    {
+        if (featureDesc->stElementList[i].varValue.ui32Value == sequenceTrigger)
+        {
+            wcstombs(triggerModeChar, reinterpret_cast<wchar_t const*>(featureDesc->stElementList[i].wszComment), CAM_FEA_COMMENT_MAX);
+            break;
+        }
+    }
+
+    BeginFeatureBatch();
+    char triggerMode[MM::MaxStrLength];
+    GetProperty(FeatureIdToName(eTriggerMode), triggerMode);
+    if (strcmp(triggerMode, triggerModeChar) != 0)
+    {
+        SetProperty(FeatureIdToName(eTriggerMode), triggerModeChar);
+    }
+    if (CommitFeatureBatch() != LX_OK)
+        return DEVICE_ERR;
+    burstRemaining_ = 0;
+
+    /* Grab stage -> frameQueue_ -> insert stage, one frame buffer per queue slot plus one held by each stage.
+       An unconverted snap is dropped, the insert stage becomes the only frames_ writer. */
+    ReleaseSnapFrame();
+    frameQueue_.Reset(queueDepth_);
+    framePool_.Resize(frameSize_.uiFrameSize, queueDepth_ + 2);
+    queuePeak_ = 0;
+    grabBusyUs_ = 0.0;
+    insertBusyUs_ = 0.0;
+    framesRemained_ = 0;
+    InterlockedExchange64(&signalTick_, 0);
+    stats_.Reset();
+    stopOnOverFlow_ = stopOnOverflow;
+    insertThd_->Start();
+
+    if (StartFrameTransfer(interval_ms) != LX_OK)
+    {
+        FinishPipeline(true);
+        return DEVICE_ERR;
+    }
+
+    thd_->Start(numImages,interval_ms);
+
+    return DEVICE_OK;
+}
+
+/*
+ * Inserts Image and MetaData into MMCore circular Buffer
+ * pixels are either the frames_ write slot (converted from frame) or frame's own buffer, frame's footer goes into the metadata
+ */
+int NikonKsCam::InsertImage(const KsFrame* frame, const unsigned char* pixels)
+{
+
+    // Image metadata
+    Metadata md;
+    char label[MM::MaxStrLength];
+    this->GetLabel(label);
+    md.put("Camera", label);
+
+    /* Per frame camera state from the footer, read in place behind the pixels */
+    const CAM_ImageInfo* info = frame->GetInfo();
+    md.put("FrameNo", CDeviceUtils::ConvertToString((long)info->usFrameNo));
+    md.put(MM::g_Keyword_Exposure, CDeviceUtils::ConvertToString(info->uiExposureTime / 1000.0));
+    md.put(MM::g_Keyword_Gain, CDeviceUtils::ConvertToString((long)info->usGain));
+    md.put("AeStay", CDeviceUtils::ConvertToString((long)info->ucAeStay));
+    md.put("RoiLeft", CDeviceUtils::ConvertToString((long)info->usRoiLeft));
+    md.put("RoiTop", CDeviceUtils::ConvertToString((long)info->usRoiTop));
+    if (info->usTrggerOptionNo != 0)
+        md.put("TriggerOptionNo", CDeviceUtils::ConvertToString((long)info->usTrggerOptionNo));
+    if (info->usMultiExposureTimeNo != 0)
+    {
+        /* 1 based index into the exposure sequence */
+        md.put("ExposureSequenceIndex", CDeviceUtils::ConvertToString((long)info->usMultiExposureTimeNo - 1));
+    }
+    md.put(MM::g_Keyword_Metadata_StartTime, CDeviceUtils::ConvertToString(sequenceStartTime_.getMsec()));
+    md.put(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((GetCurrentMMTime() - sequenceStartTime_).getMsec()));
+    md.put(MM::g_Keyword_Metadata_ImageNumber, CDeviceUtils::ConvertToString(imageCounter_));
+
+    imageCounter_++;
+
+    int ret = GetCoreCallback()->InsertImage(this, pixels,
+              imageWidth_,
+              imageHeight_,
+              byteDepth_,
+              md.Serialize().c_str());
+
+    if (!stopOnOverFlow_ && ret == DEVICE_BUFFER_OVERFLOW)
+    {
+        // do not stop on overflow, reset the buffer and insert the same image again
+        GetCoreCallback()->ClearImageBuffer(this);
+        return GetCoreCallback()->InsertImage(this, pixels,
+                                              imageWidth_,
+                                              imageHeight_,
+                                              byteDepth_,
+                                              md.Serialize().c_str());
+    } else
+        return ret;
+
+    return DEVICE_OK;
+}
+
+/*
+ * Grab stage of the sequence pipeline: waits for the driver, pulls one frame
+ * and queues it for the insert stage.
+ * Called from inside the sequence thread
+ */
+int NikonKsCam::ThreadRun (void)
+{
+    MM::MMTime startFrame = GetCurrentMMTime();
+
+    auto exposureLength = vectFeatureValue_.pstFeatureValue[featureIndex_[eExposureTime]].stVariant.ui32Value / 1000;
+    if (exposureSequenceRunning_)
+        exposureLength = exposureSequenceMaxUs_ / 1000;
+    /* Frames of a soft burst arrive back to back at sensor speed, so take every one in order */
+    bool drain = frameDropless_ || softBurst_;
+    for (;;)
+    {
+        /* Start the next burst once every frame of the previous one was collected */
+        if (softBurst_ && burstRemaining_ == 0 && framesRemained_ == 0)
+        {
+            frameDoneEvent_.Reset();
+            InterlockedExchange64(&signalTick_, 0);
+            if (Command(CAM_CMD_ONEPUSH_SOFTTRIGGER) != LX_OK)
+                return DEVICE_ERR;
+            burstRemaining_ = vectFeatureValue_.pstFeatureValue[featureIndex_[eTriggerOption]].stVariant.stTriggerOption.uiFrameCount;
+            if (burstRemaining_ == 0)
+                burstRemaining_ = 1;
+        }
+
+        /* When draining keep pulling without waiting while the driver still holds frames */
+        DWORD dwRet = MM_WAIT_OK;
+        LONGLONG waitStart = 0, wakeTick = 0;
+        if (!drain || framesRemained_ == 0)
+        {
+            waitStart = StatsNow();
+            dwRet = frameDoneEvent_.Wait(exposureLength + 300);//wait up to exposure length + 250 ms
+            wakeTick = StatsNow();
+        }
+        if (thd_->IsStopped())
+            return DEVICE_OK;
+
+        if (dwRet == MM_WAIT_TIMEOUT)
+        {
+            LogMessage("Timeout");
+            stats_.Increment(eacTimeouts);
+            /* Give up on the rest of a burst that never arrived and trigger again */
+            burstRemaining_ = 0;
+            continue;
+        }
+        else if (dwRet != MM_WAIT_OK)
+        {
+            ostringstream os;
+            os << "Unknown event status " << dwRet;
+            LogMessage(os.str());
+            return 0;
+        }
+
+        MM::MMTime startGrab = GetCurrentMMTime();
+
+        /* Wait for the insert stage to hand a buffer back if all of them are in flight */
+        KsFrame* frame;
+        while ((frame = framePool_.Acquire()) == NULL)
+        {
+            if (thd_->IsStopped())
+                return DEVICE_OK;
+            queueSpaceEvent_.Wait(100);
+        }
+
+        /* The frame signal is consumed by this grab, which takes every frame the driver holds by now
+           (the newest, or the oldest and uiRemained more). Only a frame arriving after this can set it
+           again, so a drain pass that ends at uiRemained == 0 waits for the next frame. A frame landing
+           between the Reset() and CAM_GetImage() leaves a signal with no frame behind, the grab after
+           that wait finds the driver empty, which is not an error. */
+        bool waited = !drain || framesRemained_ == 0;
+        frameDoneEvent_.Reset();
+        /* Taken after the Reset(): a callback in between leaves the event set without a tick, so the wait
+           that finds it set takes no sample */
+        LONGLONG signalTick = InterlockedExchange64(&signalTick_, 0);
+        lx_uint32 uiRemained;
+        if (GrabFrame(frame, !drain, uiRemained, waited) != LX_OK)
+        {
+            framesRemained_ = 0;
+            frame->Release();
+            continue;
+        }
+        /* Only a wait that blocked until a fresh signal is a wakeup, one that found the event already set is not */
+        if (waited && signalTick >= waitStart && signalTick != 0)
+            stats_.AddLatency(ealWakeup, wakeTick - signalTick);
+        framesRemained_ = uiRemained;
+        auto frameNo = frame->GetInfo()->usFrameNo;
+        CountFrameGap(frameNo);
+        stats_.Increment(eacGrabbed);
+        auto receivedTick = receivedTicks_[frameNo & KSCAM_RECEIVED_TICKS_MASK];
+        if (receivedTick != 0)
+        {
+            frame->SetReceivedTick(receivedTick);
+            stats_.AddLatency(ealGrab, StatsNow() - receivedTick);
+        }
+        if (burstRemaining_ > 0)
+            burstRemaining_--;
+
+        while (!frameQueue_.Push(frame))
+        {
+            if (thd_->IsStopped())
+            {
+                frame->Release();
+                return DEVICE_OK;
+            }
+            queueSpaceEvent_.Wait(100);
+        }
+        insertEvent_.Set();
+
+        auto level = frameQueue_.Size();
+        if (level > queuePeak_)
+            queuePeak_ = level;
+
+        MM::MMTime now = GetCurrentMMTime();
+        grabBusyUs_ += (now - startGrab).getUsec();
+
+        MM::MMTime frameInterval = now - startFrame;
+        if (frameInterval.getMsec() > 0.0)
+            framesPerSecond_ = 1000.0 / frameInterval.getMsec();
+
+        return DEVICE_OK;
+    }
+}
+
+/*
+ * Counts the frames missing between the previous and this footer frame number.
+ * usFrameNo wraps at 0xFFFF, so the difference is taken modulo 2^16.
+ */
+void NikonKsCam::CountFrameGap(lx_ushort16 frameNo)
+{
+    if (stats_.Get(eacGrabbed) > 0)
+    {
+        lx_ushort16 gap = (lx_ushort16)(frameNo - lastFrameNo_ - 1);
+        /* A "negative" gap is a repeated or reordered frame, not a drop */
+        if (gap != 0 && gap < 0x8000)
+        {
+            stats_.Add(eacDropped, gap);
+            ostringstream os;
+            os << gap << " frame(s) dropped before frame " << frameNo;
+            LogMessage(os.str());
+        }
+    }
+    lastFrameNo_ = frameNo;
+}
+
+/*
+ * Insert stage of the sequence pipeline: converts the oldest queued frame
+ * and inserts it into the MMCore circular buffer.
+ * Called from inside the insert thread, returns KSCAM_QUEUE_EMPTY when there was nothing to do
+ */
+int NikonKsCam::InsertRun()
+{
+    KsFrame* frame;
+    if (!frameQueue_.Pop(frame))
+        return KSCAM_QUEUE_EMPTY;
+
+    int ret = DEVICE_OK;
+    if (!insertThd_->IsDiscarding())
+    {
+        MM::MMTime startInsert = GetCurrentMMTime();
+        /* Mono16 frames go to the circular buffer straight from the driver buffer */
+        auto pixels = DirectPixels(frame);
+        bool converted = pixels == NULL;
+        if (converted)
+        {
+            ConvertFrame(frames_.Write().GetPixelsRW(), frame->GetData());
+            pixels = frames_.Write().GetPixels();
+        }
+        ret = InsertImage(frame, pixels);
+        //Newest complete frame for GetImageBuffer()
+        if (converted)
+            frames_.Publish();
+        insertBusyUs_ += (GetCurrentMMTime() - startInsert).getUsec();
+        if (ret == DEVICE_OK)
+        {
+            stats_.Increment(eacInserted);
+            if (frame->GetReceivedTick() != 0)
+                stats_.AddLatency(ealInsert, StatsNow() - frame->GetReceivedTick());
+        }
+    }
+    frame->Release();
+    queueSpaceEvent_.Set();
+
+    return ret;
+}
+
+/*
+ * Stops the insert stage, either after it drained the queue or right away
+ * (queued frames are dropped). The extra frame buffers are given back by the next SnapImage()
+ */
+void NikonKsCam::FinishPipeline(bool discard)
+{
+    if (!insertThd_->IsRunning())
+        return;
+
+    insertThd_->Finish(discard);
+    insertEvent_.Set();
+    insertThd_->wait();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Exposure sequence (MultiExposureTime feature)
+///////////////////////////////////////////////////////////////////////////////
+
+int NikonKsCam::IsExposureSequenceable(bool& isSequenceable) const
+{
+    isSequenceable = exposureSequenceable_;
+    return DEVICE_OK;
+}
+
+int NikonKsCam::GetExposureSequenceMaxLength(long& nrEvents) const
+{
+    if (!exposureSequenceable_)
+        return DEVICE_UNSUPPORTED_COMMAND;
+    nrEvents = CAM_FEA_MULTIEXPOSURETIME_MAX;
+    return DEVICE_OK;
+}
+
+int NikonKsCam::ClearExposureSequence()
+{
+    exposureSequence_.clear();
+    return DEVICE_OK;
+}
+
+int NikonKsCam::AddToExposureSequence(double exposureTime_ms)
+{
+    if (!exposureSequenceable_)
+        return DEVICE_UNSUPPORTED_COMMAND;
+    if (exposureSequence_.size() >= CAM_FEA_MULTIEXPOSURETIME_MAX)
+        return DEVICE_SEQUENCE_TOO_LARGE;
+    exposureSequence_.push_back((lx_uint32)(exposureTime_ms * 1000 + 0.5));
+    return DEVICE_OK;
+}
+
+/* MMCore declares this const, the upload only touches the cached feature values */
+int NikonKsCam::SendExposureSequence() const
+{
+    return const_cast<NikonKsCam*>(this)->UploadExposureSequence();
+}
+
+int NikonKsCam::UploadExposureSequence()
+{
+    if (!exposureSequenceable_)
+        return DEVICE_UNSUPPORTED_COMMAND;
+    if (exposureSequence_.empty())
+        return DEVICE_ERR;
+
+    CAM_FeatureValue* featureValue = &vectFeatureValue_.pstFeatureValue[featureIndex_[eMultiExposureTime]];
+    featureValue->stVariant.eVarType = evrt_MultiExposureTime;
+    featureValue->stVariant.stMultiExposureTime.uiNum = (lx_uint32)exposureSequence_.size();
+    exposureSequenceMaxUs_ = 0;
+    for (size_t i = 0; i < exposureSequence_.size(); i++)
+    {
+        featureValue->stVariant.stMultiExposureTime.uiExposureTime[i] = exposureSequence_[i];
+        if (exposureSequence_[i] > exposureSequenceMaxUs_)
+            exposureSequenceMaxUs_ = exposureSequence_[i];
+    }
+    bool ownBatch = !featureBatch_;
+    if (ownBatch)
+        BeginFeatureBatch();
+    SetFeature(eMultiExposureTime);
+    if (ownBatch && CommitFeatureBatch() != LX_OK)
+        return DEVICE_ERR;
+    return DEVICE_OK;
+}
+
+/* Switches the exposure mode to MultiExposureTime, the camera then cycles through the uploaded times frame by frame */
+int NikonKsCam::StartExposureSequence()
+{
+    if (!exposureSequenceable_)
+        return DEVICE_UNSUPPORTED_COMMAND;
+    if (exposureSequenceRunning_)
+        return DEVICE_OK;
+
+    CAM_FeatureValue* featureValue = &vectFeatureValue_.pstFeatureValue[featureIndex_[eExposureMode]];
+    exposureModeBeforeSequence_ = featureValue->stVariant.ui32Value;
+    featureValue->stVariant.ui32Value = ecemMultiExposureTime;
+    bool ownBatch = !featureBatch_;
+    if (ownBatch)
+        BeginFeatureBatch();
+    SetFeature(eExposureMode);
+    if (ownBatch && CommitFeatureBatch() != LX_OK)
+        return DEVICE_ERR;
+    exposureSequenceRunning_ = true;
+    return DEVICE_OK;
+}
+
+int NikonKsCam::StopExposureSequence()
+{
+    if (!exposureSequenceRunning_)
+        return DEVICE_OK;
+
+    exposureSequenceRunning_ = false;
+    CAM_FeatureValue* featureValue = &vectFeatureValue_.pstFeatureValue[featureIndex_[eExposureMode]];
+    featureValue->stVariant.ui32Value = exposureModeBeforeSequence_;
+    if (SetFeature(eExposureMode) != LX_OK)
+        return DEVICE_ERR;
+    return DEVICE_OK;
+}
+
+bool NikonKsCam::IsCapturing() {
+    return !thd_->IsStopped();
+}
+
+/*
+ * called from the thread function before exit
+ */
+void NikonKsCam::OnThreadExiting() throw()
+{
+    try
+    {
+        LogMessage(g_Msg_SEQUENCE_ACQUISITION_THREAD_EXITING);
+        GetCoreCallback()?GetCoreCallback()->AcqFinished(this,0):DEVICE_OK;
+    }
+    catch(...)
+    {
+        LogMessage(g_Msg_EXCEPTION_IN_ON_THREAD_EXITING, false);
+    }
+}
+
+
+MySequenceThread::MySequenceThread(NikonKsCam* pCam)
+    :stop_(true)
+    ,suspend_(false)
+    ,numImages_(default_numImages)
+    ,imageCounter_(0)
+    ,intervalMs_(default_intervalMS)
+    ,startTime_(0)
+    ,actualDuration_(0)
+    ,lastFrameTime_(0)
+    ,camera_(pCam)
+{};
+
+MySequenceThread::~MySequenceThread() {};
+
+void MySequenceThread::Stop() {
+    MMThreadGuard(this->stopLock_);
+    stop_=true;
+}
+
+void MySequenceThread::Start(long numImages, double intervalMs)
+{
+    MMThreadGuard(this->stopLock_);
+    MMThreadGuard(this->suspendLock_);
+    numImages_=numImages;
+    intervalMs_=intervalMs;
+    imageCounter_=0;
+    stop_ = false;
+    suspend_=false;
+    activate();
+    actualDuration_ = 0;
+    //startTime_= camera_->GetCurrentMMTime();
+    lastFrameTime_ = 0;
+}
+
+bool MySequenceThread::IsStopped() {
+    MMThreadGuard(this->stopLock_);
+    return stop_;
+}
+
+void MySequenceThread::Suspend() {
+    MMThreadGuard(this->suspendLock_);
+    suspend_ = true;
+}
+
+bool MySequenceThread::IsSuspended() {
+    MMThreadGuard(this->suspendLock_);
+    return suspend_;
+}
+
+void MySequenceThread::Resume() {
+    MMThreadGuard(this->suspendLock_);
+    suspend_ = false;
+}
+
+int MySequenceThread::svc(void) throw()
+{
+    int ret = DEVICE_ERR;
+
+    bool interrupted = true;
+
+    try
+    {
+        do
+        {
+            ret = camera_->ThreadRun();
+        } while (DEVICE_OK == ret && !IsStopped() && imageCounter_++ < numImages_-1);
+
+        interrupted = IsStopped();
+        if (interrupted)
+            camera_->LogMessage("SeqAcquisition interrupted by the user\n");
+
+    } catch(...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    /* Let the insert stage finish the frames already grabbed unless we were stopped */
+    camera_->FinishPipeline(interrupted);
+    stop_=true;
+    actualDuration_ = camera_->GetCurrentMMTime() - startTime_;
+    camera_->OnThreadExiting();
+
+    return ret;
+}
+
+
+MyInsertThread::MyInsertThread(NikonKsCam* pCam)
+    :running_(false)
+    ,finish_(false)
+    ,discard_(false)
+    ,camera_(pCam)
+{};
+
+MyInsertThread::~MyInsertThread() {};
+
+void MyInsertThread::Start()
+{
+    finish_ = false;
+    discard_ = false;
+    running_ = true;
+    activate();
+}
+
+void MyInsertThread::Finish(bool discard)
+{
+    discard_ = discard;
+    finish_ = true;
+}
+
+int MyInsertThread::svc(void) throw()
+{
+    int ret = DEVICE_OK;
+
+    try
+    {
+        for (;;)
+        {
+            /* finish_ is read before the queue so a frame pushed just before Finish() is not lost */
+            bool finishing = finish_;
+            ret = camera_->InsertRun();
+            if (ret == KSCAM_QUEUE_EMPTY)
+            {
+                ret = DEVICE_OK;
+                if (finishing)
+                    break;
+                camera_->insertEvent_.Wait(100);
+            }
+            else if (ret != DEVICE_OK)
+            {
+                camera_->LogMessage("Insert stage error, stopping sequence acquisition");
+                camera_->thd_->Stop();
+                discard_ = true;
+            }
+        }
+    } catch(...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    running_ = false;
+
+    return ret;
+}
+
+
+MyEventThread::MyEventThread(NikonKsCam* pCam)
+    :running_(false)
+    ,quit_(false)
+    ,camera_(pCam)
+{};
+
+MyEventThread::~MyEventThread()
+{
+    Stop();
+};
+
+void MyEventThread::Start()
+{
+    if (running_)
+        return;
+    quit_ = false;
+    running_ = true;
+    activate();
+}
+
+void MyEventThread::Stop()
+{
+    if (!running_)
+        return;
+    quit_ = true;
+    wake_.Set();
+    wait();
+    running_ = false;
+}
+
+int MyEventThread::svc(void) throw()
+{
+    KsEventRecord record;
+
+    while (!quit_)
+    {
+        wake_.Wait(100);
+        try
+        {
+            while (camera_->eventRing_.Pop(record))
+                camera_->HandleEventRecord(record);
+        } catch(...) {
+            camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+        }
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MyPrefetchThread
+///////////////////////////////////////////////////////////////////////////////
+
+MyPrefetchThread::MyPrefetchThread(NikonKsCam* pCam)
+    :running_(false)
+    ,quit_(false)
+    ,camera_(pCam)
+{};
+
+MyPrefetchThread::~MyPrefetchThread()
+{
+    Stop();
+};
+
+void MyPrefetchThread::Start()
+{
+    Stop();
+    quit_ = false;
+    running_ = true;
+    activate();
+}
+
+/* Returns once the descriptor being fetched (if any) is done */
+void MyPrefetchThread::Stop()
+{
+    if (!running_)
+        return;
+    quit_ = true;
+    wait();
+    running_ = false;
+}
+
+/* Loads every descriptor no property asked for during Initialize */
+int MyPrefetchThread::svc(void) throw()
+{
+    MM::MMTime startPrefetch = camera_->GetCurrentMMTime();
+    lx_uint32 count = camera_->vectFeatureValue_.uiCountUsed;
+    lx_uint32 i;
+
+    try
+    {
+        for (i = 0; i < count && !quit_; i++)
+            camera_->LoadFeatureDesc(camera_->vectFeatureValue_.pstFeatureValue[i].uiFeatureId);
+        /* Still before EndDescPrefetch(), so no record is rewritten while the cache file is written */
+        if (i == count)
+            camera_->FinishDescCache();
+
+        std::ostringstream os;
+        os << "Descriptor prefetch: " << i << " of " << count << " features in "
+           << (camera_->GetCurrentMMTime() - startPrefetch).getMsec() << " ms";
+        camera_->LogMessage(os.str().c_str(), true);
+    } catch(...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    try
+    {
+        camera_->EndDescPrefetch(!quit_);
+    } catch(...) {
+        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+    }
+    return 0;
+}
+
+/* Bookkeeping and logging for an event taken off the ring, runs on the event thread */
+void NikonKsCam::HandleEventRecord(const KsEventRecord& record)
+{
+    switch (record.eEventType)
+    {
+    case    ecetImageReceived:
+    {
+        stats_.Increment(eacReceived);
+        ostringstream os;
+        os << "ImageRecieved Frameno=" << record.uiFrameNo << " uiRemain= " << record.uiRemained << endl;
+        LogMessage(os.str().c_str());
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// NikonKsCam Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+/*Pre-initialization property which shows cameras (and simulators) detected */
+int NikonKsCam::OnCameraSelection(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(camID_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string value;
+        pProp->Get(value);
+        strcpy(camID_, value.c_str());
+    }
+    return DEVICE_OK;
+}
+
+/* Bin 3 switches to the sensor's 1/3 average format, 2 and 4 bin the full resolution format in software.
+   Either way the ROI goes back to full frame. */
+int NikonKsCam::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        long value;
+        pProp->Get(value);
+        unsigned hwBin = value == 3 ? 3 : 1;
+        KsFormat* format = formats_.FindBinned(format_.stFormat.eColor, format_.eSensorMode, hwBin);
+        if (format == NULL)
+        {
+            LogMessage("Binning: no image format for this binning.");
+            pProp->Set(binSize_);
+            return DEVICE_INVALID_PROPERTY_VALUE;
+        }
+
+        swBin_ = hwBin == 1 ? (unsigned)value : 1;
+        roiActive_ = false;
+        CAM_Position position = {0, 0};
+        int nRet = ApplyROI(*format, position);
+        if (nRet != DEVICE_OK)
+            return nRet;
+    }
+    if (eAct == MM::BeforeGet || eAct == MM::AfterSet)
+    {
+        pProp->Set(binSize_);
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnOutputMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(outputMode_ == eomLuminance16 ? g_OutputLuminance16 : (outputMode_ == eomGreen8 ? g_OutputGreen : g_OutputBGRA));
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        string value;
+        pProp->Get(value);
+        if (value == g_OutputLuminance16)
+            outputMode_ = eomLuminance16;
+        else if (value == g_OutputGreen)
+            outputMode_ = eomGreen8;
+        else
+            outputMode_ = eomBGRA;
+        //Pixel type and buffer size follow the output mode
+        UpdateImageSettings();
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnBinningMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(binMean_ ? g_BinningMean : g_BinningSum);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        string value;
+        pProp->Get(value);
+        binMean_ = value == g_BinningMean;
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnConvertThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)convertThreads_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+        long value;
+        pProp->Get(value);
+        convertThreads_ = value;
+        convertPool_.SetThreadCount(convertThreads_);
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnBufferMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(bufferAuto_ ? "Auto" : "Manual");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string value;
+        pProp->Get(value);
+        bufferAuto_ = (value == "Auto");
+    }
+    return DEVICE_OK;
+}
+
+/* Only used in Manual mode, takes effect the next time frame transfer starts */
+int NikonKsCam::OnBufferCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)bufferCount_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        long value;
+        pProp->Get(value);
+        bufferCount_ = value;
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnBuffersAllocated(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)buffersAllocated_);
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnSequenceTrigger(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(softBurst_ ? g_SequenceSoftBurst : g_SequenceFreeRun);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        std::string value;
+        pProp->Get(value);
+        softBurst_ = (value == g_SequenceSoftBurst);
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnWarmSnap(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(warmSnap_ ? "ON" : "OFF");
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string value;
+        pProp->Get(value);
+        warmSnap_ = (value == "ON");
+        if (!warmSnap_)
+            DisarmWarmSnap();
+    }
+    return DEVICE_OK;
+}
+
+/* Time from entering SnapImage until the last frame was grabbed, its conversion happens later in GetImageBuffer() */
+int NikonKsCam::OnSnapLatency(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(snapLatencyMs_);
+    }
+    return DEVICE_OK;
+}
+
+int NikonKsCam::OnFeatureBatch(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(featureBatch_ ? g_FeatureBatchBegin : g_FeatureBatchCommit);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        std::string value;
+        pProp->Get(value);
+        if (value == g_FeatureBatchBegin)
+        {
+            BeginFeatureBatch();
+        }
+        else if (CommitFeatureBatch() != LX_OK)
+        {
+            return DEVICE_ERR;
+        }
+    }
     return DEVICE_OK;
 }
 
-int NikonKsCam::GetComponentName(unsigned comp, char* name)
+int NikonKsCam::OnFrameInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    if (comp > 4)
+    if (eAct == MM::BeforeGet)
     {
-        name = "invalid comp";
-        return DEVICE_ERR;
+        pProp->Set(FrameIntervalMs());
     }
-
-    std::string rgba("RGBA");
-    CDeviceUtils::CopyLimitedString(name, &rgba.at(comp));
-
     return DEVICE_OK;
 }
 
-
-//Sequence functions, mostly copied from other drivers with slight modification
-/**
- * Required by the MM::Camera API
- * Please implement this yourself and do not rely on the base class implementation
- * The Base class implementation is deprecated and will be removed shortly
- */
-int NikonKsCam::StartSequenceAcquisition(double interval) {
-    return StartSequenceAcquisition(LONG_MAX, interval, false);
-}
-
-/**
-* Stop and wait for the Sequence thread finished
-*/
-int NikonKsCam::StopSequenceAcquisition()
+/* Duration of the last CommitFeatureBatch(), including the format dependent refresh */
+int NikonKsCam::OnBatchCommitTime(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    Command(CAM_CMD_STOP_FRAMETRANSFER);
-    if (!thd_->IsStopped()) {
-        thd_->Stop();
-        thd_->wait();
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(batchCommitMs_);
     }
-
     return DEVICE_OK;
 }
 
-/**
-* Simple implementation of Sequence Acquisition
-* A sequence acquisition should run on its own thread and transport new images
-* coming of the camera into the MMCore circular buffer.
-*/
-int NikonKsCam::StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow)
+int NikonKsCam::OnFrameDropless(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    char triggerOffChar[10];
-    if (IsCapturing())
-        return DEVICE_CAMERA_BUSY_ACQUIRING;
-
-    auto ret = GetCoreCallback()->PrepareForAcq(this);
-    if (ret != DEVICE_OK)
-        return ret;
-    sequenceStartTime_ = GetCurrentMMTime();
-    imageCounter_ = 0;
-
-    auto*   featureDesc = &featureDesc_[mapFeatureIndex_[eTriggerMode]];
-    wcstombs(triggerOffChar, reinterpret_cast<wchar_t const*>(featureDesc->stElementList[ectmOff].wszComment), CAM_FEA_COMMENT_MAX);
-
-    char triggerMode[MM::MaxStrLength];
-    /* if not in trigger mode:off set to trigger mode: off (for "live view") */
-    GetProperty(ConvFeatureIdToName(eTriggerMode), triggerMode);
-    if (strcmp(triggerMode, triggerOffChar) != 0)
+    if (eAct == MM::BeforeGet)
     {
-        SetProperty(ConvFeatureIdToName(eTriggerMode), "OFF");
+        pProp->Set(frameDropless_ ? "ON" : "OFF");
     }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
 
-    Command(CAM_CMD_START_FRAMETRANSFER);
-
-    thd_->Start(numImages,interval_ms);
-    stopOnOverFlow_ = stopOnOverflow;
+        std::string value;
+        pProp->Get(value);
 
+        CAM_CMD_FrameDropless stCmd;
+        stCmd.bSet = true;
+        stCmd.bOnOff = (value == "ON");
+        auto result = CAM_Command(cameraHandle_, CAM_CMD_FRAME_DROPLESS, &stCmd);
+        if (result != LX_OK)
+        {
+            LogMessage("CAM_Command frame dropless error");
+            return DEVICE_ERR;
+        }
+        frameDropless_ = stCmd.bOnOff;
+    }
     return DEVICE_OK;
 }
 
-/*
- * Inserts Image and MetaData into MMCore circular Buffer
- */
-int NikonKsCam::InsertImage()
+/* data is the index into g_StatsCounters */
+int NikonKsCam::OnStatsCounter(MM::PropertyBase* pProp, MM::ActionType eAct, long data)
 {
-
-    // Image metadata
-    Metadata md;
-    char label[MM::MaxStrLength];
-    this->GetLabel(label);
-    md.put("Camera", label);
-    md.put(MM::g_Keyword_Metadata_StartTime, CDeviceUtils::ConvertToString(sequenceStartTime_.getMsec()));
-    md.put(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((GetCurrentMMTime() - sequenceStartTime_).getMsec()));
-    md.put(MM::g_Keyword_Metadata_ImageNumber, CDeviceUtils::ConvertToString(imageCounter_));
-
-    imageCounter_++;
-
-    MMThreadGuard g(imgPixelsLock_);
-
-    int ret = GetCoreCallback()->InsertImage(this, img_.GetPixels(),
-              img_.Width(),
-              img_.Height(),
-              img_.Depth(),
-              md.Serialize().c_str());
-
-    if (!stopOnOverFlow_ && ret == DEVICE_BUFFER_OVERFLOW)
+    if (eAct == MM::BeforeGet)
     {
-        // do not stop on overflow, reset the buffer and insert the same image again
-        GetCoreCallback()->ClearImageBuffer(this);
-        return GetCoreCallback()->InsertImage(this, img_.GetPixels(),
-                                              img_.Width(),
-                                              img_.Height(),
-                                              img_.Depth(),
-                                              md.Serialize().c_str());
-    } else
-        return ret;
-
+        pProp->Set(stats_.Get(g_StatsCounters[data].counter));
+    }
     return DEVICE_OK;
 }
 
-/*
- * Do actual capturing
- * Called from inside the thread
- */
-int NikonKsCam::ThreadRun (void)
+/* data is the index into g_StatsLatencies */
+int NikonKsCam::OnStatsLatency(MM::PropertyBase* pProp, MM::ActionType eAct, long data)
 {
-    MM::MMTime startFrame = GetCurrentMMTime();
-
-    auto exposureLength = vectFeatureValue_.pstFeatureValue[mapFeatureIndex_[eExposureTime]].stVariant.ui32Value / 1000;
-    DWORD dwRet = frameDoneEvent_.Wait(exposureLength + 300);//wait up to exposure length + 250 ms
-
-    if (dwRet == MM_WAIT_TIMEOUT)
+    if (eAct == MM::BeforeGet)
     {
-        LogMessage("Timeout");
-        return 0;
+        pProp->Set(stats_.GetLatencyMs(g_StatsLatencies[data].latency, g_StatsLatencies[data].percentile));
     }
-    else if (dwRet == MM_WAIT_OK)
-    {
-        GrabFrame();
-
-        auto ret = InsertImage();
-
-        MM::MMTime frameInterval = GetCurrentMMTime() - startFrame;
-        if (frameInterval.getMsec() > 0.0)
-            framesPerSecond_ = 1000.0 / frameInterval.getMsec();
+    return DEVICE_OK;
+}
 
-        return ret;
+int NikonKsCam::OnStatsFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set(statsFile_.c_str());
     }
-    else
+    else if (eAct == MM::AfterSet)
     {
-        ostringstream os;
-        os << "Unknown event status " << dwRet;
-        LogMessage(os.str());
-        return 0;
+        pProp->Get(statsFile_);
+        RestartStatsMonitor();
     }
-
-    return 1;
-};
-
-bool NikonKsCam::IsCapturing() {
-    return !thd_->IsStopped();
+    return DEVICE_OK;
 }
 
-/*
- * called from the thread function before exit
- */
-void NikonKsCam::OnThreadExiting() throw()
+int NikonKsCam::OnStatsInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    try
+    if (eAct == MM::BeforeGet)
     {
-        LogMessage(g_Msg_SEQUENCE_ACQUISITION_THREAD_EXITING);
-        GetCoreCallback()?GetCoreCallback()->AcqFinished(this,0):DEVICE_OK;
+        pProp->Set(statsIntervalMs_);
     }
-    catch(...)
+    else if (eAct == MM::AfterSet)
     {
-        LogMessage(g_Msg_EXCEPTION_IN_ON_THREAD_EXITING, false);
+        pProp->Get(statsIntervalMs_);
+        RestartStatsMonitor();
     }
+    return DEVICE_OK;
 }
 
-
-MySequenceThread::MySequenceThread(NikonKsCam* pCam)
-    :stop_(true)
-    ,suspend_(false)
-    ,numImages_(default_numImages)
-    ,imageCounter_(0)
-    ,intervalMs_(default_intervalMS)
-    ,startTime_(0)
-    ,actualDuration_(0)
-    ,lastFrameTime_(0)
-    ,camera_(pCam)
-{};
-
-MySequenceThread::~MySequenceThread() {};
-
-void MySequenceThread::Stop() {
-    MMThreadGuard(this->stopLock_);
-    stop_=true;
-}
-
-void MySequenceThread::Start(long numImages, double intervalMs)
+void NikonKsCam::RestartStatsMonitor()
 {
-    MMThreadGuard(this->stopLock_);
-    MMThreadGuard(this->suspendLock_);
-    numImages_=numImages;
-    intervalMs_=intervalMs;
-    imageCounter_=0;
-    stop_ = false;
-    suspend_=false;
-    activate();
-    actualDuration_ = 0;
-    //startTime_= camera_->GetCurrentMMTime();
-    lastFrameTime_ = 0;
-}
-
-bool MySequenceThread::IsStopped() {
-    MMThreadGuard(this->stopLock_);
-    return stop_;
-}
-
-void MySequenceThread::Suspend() {
-    MMThreadGuard(this->suspendLock_);
-    suspend_ = true;
-}
-
-bool MySequenceThread::IsSuspended() {
-    MMThreadGuard(this->suspendLock_);
-    return suspend_;
+    if (statsFile_.empty())
+        statsMonitor_->Stop();
+    else
+        statsMonitor_->Start(statsFile_, statsIntervalMs_);
 }
 
-void MySequenceThread::Resume() {
-    MMThreadGuard(this->suspendLock_);
-    suspend_ = false;
+int NikonKsCam::OnQueueDepth(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
+    {
+        pProp->Set((long)queueDepth_);
+    }
+    else if (eAct == MM::AfterSet)
+    {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+        long value;
+        pProp->Get(value);
+        queueDepth_ = value;
+    }
+    return DEVICE_OK;
 }
 
-int MySequenceThread::svc(void) throw()
+int NikonKsCam::OnQueueLevel(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    int ret = DEVICE_ERR;
-
-    try
+    if (eAct == MM::BeforeGet)
     {
-        do
-        {
-            ret = camera_->ThreadRun();
-        } while (DEVICE_OK == ret && !IsStopped() && imageCounter_++ < numImages_-1);
-
-        if (IsStopped())
-            camera_->LogMessage("SeqAcquisition interrupted by the user\n");
-
-    } catch(...) {
-        camera_->LogMessage(g_Msg_EXCEPTION_IN_THREAD, false);
+        pProp->Set((long)frameQueue_.Size());
     }
-    stop_=true;
-    actualDuration_ = camera_->GetCurrentMMTime() - startTime_;
-    camera_->OnThreadExiting();
-
-    return ret;
+    return DEVICE_OK;
 }
 
-
-///////////////////////////////////////////////////////////////////////////////
-// NikonKsCam Action handlers
-///////////////////////////////////////////////////////////////////////////////
-
-/*Pre-initialization property which shows cameras (and simulators) detected */
-int NikonKsCam::OnCameraSelection(MM::PropertyBase* pProp, MM::ActionType eAct)
+int NikonKsCam::OnQueuePeak(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set(camID_);
+        pProp->Set((long)queuePeak_);
     }
-    else if (eAct == MM::AfterSet)
+    return DEVICE_OK;
+}
+
+/* Share of the time since the sequence started that each stage spent working */
+int NikonKsCam::OnGrabStageBusy(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+    if (eAct == MM::BeforeGet)
     {
-        string value;
-        pProp->Get(value);
-        strcpy(camID_, value.c_str());
+        double elapsedUs = (GetCurrentMMTime() - sequenceStartTime_).getUsec();
+        pProp->Set(elapsedUs > 0.0 ? 100.0 * grabBusyUs_ / elapsedUs : 0.0);
     }
     return DEVICE_OK;
 }
 
-/*Nikon Ks cam only has hardware bin 3 which is handled by Image Format setting*/
-int NikonKsCam::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+int NikonKsCam::OnInsertStageBusy(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
+    if (eAct == MM::BeforeGet)
+    {
+        double elapsedUs = (GetCurrentMMTime() - sequenceStartTime_).getUsec();
+        pProp->Set(elapsedUs > 0.0 ? 100.0 * insertBusyUs_ / elapsedUs : 0.0);
+    }
     return DEVICE_OK;
 }
 
@@ -1401,6 +3140,8 @@ int NikonKsCam::OnExposureTime(MM::PropertyBase* pProp , MM::ActionType eAct)
 
 int NikonKsCam::OnTriggerMode(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
+    if (eAct == MM::AfterSet)
+        DisarmWarmSnap();
     return OnList(pProp, eAct, eTriggerMode);
 }
 
@@ -1497,9 +3238,13 @@ int NikonKsCam::OnGainLimit(MM::PropertyBase* pProp, MM::ActionType eAct)
 int NikonKsCam::OnMeteringAreaLeft(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     long value;
-    lx_uint32 index = mapFeatureIndex_[eMeteringArea];
+    lx_uint32 index = featureIndex_[eMeteringArea];
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
+    //Limits follow the format, refreshed here when it changed
+    if (eAct == MM::BeforeGet)
+        UpdateDerivedState(efeLimits);
+
     if (eAct == MM::AfterSet)
     {
         pProp->Get(value);
@@ -1517,9 +3262,13 @@ int NikonKsCam::OnMeteringAreaLeft(MM::PropertyBase* pProp, MM::ActionType eAct)
 int NikonKsCam::OnMeteringAreaTop(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     long value;
-    lx_uint32 index = mapFeatureIndex_[eMeteringArea];
+    lx_uint32 index = featureIndex_[eMeteringArea];
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
+    //Limits follow the format, refreshed here when it changed
+    if (eAct == MM::BeforeGet)
+        UpdateDerivedState(efeLimits);
+
     if (eAct == MM::AfterSet)
     {
         pProp->Get(value);
@@ -1537,9 +3286,13 @@ int NikonKsCam::OnMeteringAreaTop(MM::PropertyBase* pProp, MM::ActionType eAct)
 int NikonKsCam::OnMeteringAreaWidth(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     long value;
-    lx_uint32 index = mapFeatureIndex_[eMeteringArea];
+    lx_uint32 index = featureIndex_[eMeteringArea];
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
+    //Limits follow the format, refreshed here when it changed
+    if (eAct == MM::BeforeGet)
+        UpdateDerivedState(efeLimits);
+
     if (eAct == MM::AfterSet)
     {
         pProp->Get(value);
@@ -1556,9 +3309,13 @@ int NikonKsCam::OnMeteringAreaWidth(MM::PropertyBase* pProp, MM::ActionType eAct
 
 int NikonKsCam::OnMeteringAreaHeight(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    lx_uint32 index = mapFeatureIndex_[eMeteringArea];
+    lx_uint32 index = featureIndex_[eMeteringArea];
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
+    //Limits follow the format, refreshed here when it changed
+    if (eAct == MM::BeforeGet)
+        UpdateDerivedState(efeLimits);
+
     if (eAct == MM::AfterSet)
     {
         long value;
@@ -1576,9 +3333,13 @@ int NikonKsCam::OnMeteringAreaHeight(MM::PropertyBase* pProp, MM::ActionType eAc
 
 int NikonKsCam::OnRoiX(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    lx_uint32 index = mapFeatureIndex_[eRoiPosition];
+    lx_uint32 index = featureIndex_[eRoiPosition];
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
+    //Limits follow the format, refreshed here when it changed
+    if (eAct == MM::BeforeGet)
+        UpdateDerivedState(efeLimits);
+
     if (eAct == MM::AfterSet)
     {
         long value;
@@ -1596,9 +3357,13 @@ int NikonKsCam::OnRoiX(MM::PropertyBase* pProp, MM::ActionType eAct)
 
 int NikonKsCam::OnRoiY(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    lx_uint32 index = mapFeatureIndex_[eRoiPosition];
+    lx_uint32 index = featureIndex_[eRoiPosition];
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
+    //Limits follow the format, refreshed here when it changed
+    if (eAct == MM::BeforeGet)
+        UpdateDerivedState(efeLimits);
+
     if (eAct == MM::AfterSet)
     {
         long value;
@@ -1618,12 +3383,12 @@ int NikonKsCam::OnRoiY(MM::PropertyBase* pProp, MM::ActionType eAct)
 int NikonKsCam::OnTriggerFrame(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
     long value;
-    lx_uint32 index = mapFeatureIndex_[eTriggerOption];
+    lx_uint32 index = featureIndex_[eTriggerOption];
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
     if (eAct == MM::BeforeGet)
     {
-        pProp->Set((long)vectFeatureValue_.pstFeatureValue[index].stVariant.stTriggerOption.iDelayTime);
+        pProp->Set((long)vectFeatureValue_.pstFeatureValue[index].stVariant.stTriggerOption.uiFrameCount);
     }
     else if (eAct == MM::AfterSet)
     {
@@ -1636,7 +3401,7 @@ int NikonKsCam::OnTriggerFrame(MM::PropertyBase* pProp, MM::ActionType eAct)
 
 int NikonKsCam::OnTriggerDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    lx_uint32 index = mapFeatureIndex_[eTriggerOption];
+    lx_uint32 index = featureIndex_[eTriggerOption];
     long value;
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
@@ -1655,33 +3420,30 @@ int NikonKsCam::OnTriggerDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
 
 int NikonKsCam::OnImageFormat(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-    char strWork[30];
+    string label;
     lx_uint32 uiFeatureId = eFormat;
-    lx_uint32 index = mapFeatureIndex_[uiFeatureId];
+    lx_uint32 index = featureIndex_[uiFeatureId];
     CAM_FeatureDesc*    featureDesc;
     CAM_FeatureValue*   featureValue;
     featureValue = &vectFeatureValue_.pstFeatureValue[index];
-    featureDesc = &featureDesc_[index];
+    featureDesc = LoadFeatureDesc(uiFeatureId);
 
     if (eAct == MM::AfterSet)
     {
+        if (IsCapturing())
+            return DEVICE_CAMERA_BUSY_ACQUIRING;
+
         string value;
-        lx_uint32 i, index;
         pProp->Get(value);
-        for (i = 0; i < featureDesc->uiListCount; i++)
+        //The driver buffers are sized for the old format
+        DisarmWarmSnap();
+        int i = featureLabels_.Find(*featureDesc, value);
+        if (i >= 0)
         {
-            wcstombs(strWork, featureDesc->stFormatList[i].wszComment, CAM_FEA_COMMENT_MAX);
-            if (value.compare(strWork) == 0)
-            {
-                LogMessage(strWork);
-                featureValue->stVariant.stFormat = featureDesc->stFormatList[i].stFormat;
-                SetFeature(featureValue->uiFeatureId);
-                UpdateImageSettings();
-                //Update ROI, MeteringArea limits, they change with format setting
-                SetROILimits();
-                SetMeteringAreaLimits();
-                break;
-            }
+            LogMessage(value);
+            featureValue->stVariant.stFormat = featureDesc->stFormatList[i].stFormat;
+            //Image settings follow right away, ROI and MeteringArea limits on their next read
+            SetFeature(featureValue->uiFeatureId);
         }
     }
     if (eAct == MM::BeforeGet || eAct == MM::AfterSet )
@@ -1690,8 +3452,8 @@ int NikonKsCam::OnImageFormat(MM::PropertyBase* pProp, MM::ActionType eAct)
         {
             if (featureDesc->stFormatList[i].stFormat == featureValue->stVariant.stFormat)
             {
-                wcstombs(strWork, featureDesc->stFormatList[i].wszComment, CAM_FEA_COMMENT_MAX);
-                pProp->Set(strWork);
+                if (featureLabels_.Label(*featureDesc, i, label))
+                    pProp->Set(label.c_str());
                 break;
             }
         }
@@ -1702,7 +3464,7 @@ int NikonKsCam::OnImageFormat(MM::PropertyBase* pProp, MM::ActionType eAct)
 //Generic - Handle "Range" feature
 int NikonKsCam::OnRange(MM::PropertyBase* pProp, MM::ActionType eAct, lx_uint32 uiFeatureId)
 {
-    lx_uint32 index = mapFeatureIndex_[uiFeatureId];
+    lx_uint32 index = featureIndex_[uiFeatureId];
     long value;
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
     switch (featureValue->stVariant.eVarType) {
@@ -1735,9 +3497,9 @@ int NikonKsCam::OnRange(MM::PropertyBase* pProp, MM::ActionType eAct, lx_uint32
 //Generic - Handle "List" feature
 int NikonKsCam::OnList(MM::PropertyBase* pProp, MM::ActionType eAct, lx_uint32 uiFeatureId)
 {
-    char strWork[30];
-    lx_uint32 index = mapFeatureIndex_[uiFeatureId];
-    CAM_FeatureDesc*    featureDesc = &featureDesc_[index];
+    string label;
+    lx_uint32 index = featureIndex_[uiFeatureId];
+    CAM_FeatureDesc*    featureDesc = LoadFeatureDesc(uiFeatureId);
     CAM_FeatureValue*   featureValue = &vectFeatureValue_.pstFeatureValue[index];
 
     if (eAct == MM::BeforeGet)
@@ -1746,8 +3508,8 @@ int NikonKsCam::OnList(MM::PropertyBase* pProp, MM::ActionType eAct, lx_uint32 u
         {
             if (featureDesc->stElementList[i].varValue.ui32Value == featureValue->stVariant.ui32Value)
             {
-                wcstombs(strWork, featureDesc->stElementList[i].wszComment, CAM_FEA_COMMENT_MAX);
-                pProp->Set(strWork);
+                if (featureLabels_.Label(*featureDesc, i, label))
+                    pProp->Set(label.c_str());
                 break;
             }
         }
@@ -1755,18 +3517,12 @@ int NikonKsCam::OnList(MM::PropertyBase* pProp, MM::ActionType eAct, lx_uint32 u
     else if (eAct == MM::AfterSet)
     {
         string value;
-        lx_uint32 i;
         pProp->Get(value);
-        for (i = 0; i < featureDesc->uiListCount; i++)
+        int i = featureLabels_.Find(*featureDesc, value);
+        if (i >= 0)
         {
-            wcstombs(strWork, featureDesc->stElementList[i].wszComment, CAM_FEA_COMMENT_MAX);
-            if (value.compare(strWork) == 0)
-            {
-                featureValue->stVariant.ui32Value = featureDesc->stElementList[i].varValue.ui32Value;
-                SetFeature(featureValue->uiFeatureId);
-                UpdateImageSettings();
-                break;
-            }
+            featureValue->stVariant.ui32Value = featureDesc->stElementList[i].varValue.ui32Value;
+            SetFeature(featureValue->uiFeatureId);
         }
 
 
@@ -1777,7 +3533,7 @@ int NikonKsCam::OnList(MM::PropertyBase* pProp, MM::ActionType eAct, lx_uint32 u
 //Generic- Set either exposure time or exposure time limit
 int NikonKsCam::OnExposureChange(MM::PropertyBase* pProp, MM::ActionType eAct, lx_uint32 uiFeatureId)
 {
-    lx_uint32 index = mapFeatureIndex_[uiFeatureId];
+    lx_uint32 index = featureIndex_[uiFeatureId];
 
     if (eAct == MM::BeforeGet)
     {
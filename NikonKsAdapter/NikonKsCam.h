@@ -29,6 +29,15 @@
 #include "../../../MMDevice/DeviceUtils.h"
 #include "../../../MMDevice/DeviceThreads.h"
 #include "DeviceEvents.h"
+#include "ImageConvert.h"
+#include "ConvertWorkers.h"
+#include "FramePool.h"
+#include "SpscQueue.h"
+#include "TripleBuffer.h"
+#include "AcqStats.h"
+#include "FeatureRegistry.h"
+#include "DescCache.h"
+#include "FormatTable.h"
 
 #include <KsCam.h>
 #include <KsCamCommand.h>
@@ -36,7 +45,6 @@
 #include <KsCamFeature.h>
 #include <KsCamImage.h>
 
-#include <map>
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -47,7 +55,21 @@
 // NikonKsCam class
 //////////////////////////////////////////////////////////////////////////////
 
+#define KSCAM_RECEIVED_TICKS	256
+
 class MySequenceThread;
+class MyInsertThread;
+class MyEventThread;
+class MyPrefetchThread;
+
+/* Fixed size copy of a callback event, passed from the SDK callback thread to MyEventThread */
+struct KsEventRecord
+{
+	ECamEventType eEventType;
+	lx_int64 tick;			// StatsNow() when the callback ran
+	lx_uint32 uiFrameNo;
+	lx_uint32 uiRemained;
+};
 
 class NikonKsCam : public CCameraBase<NikonKsCam>
 {
@@ -66,11 +88,11 @@ public:
 	int SnapImage();
 	const unsigned char* GetImageBuffer();
 
-	unsigned GetImageWidth() const{return img_.Width();};
-	unsigned GetImageHeight() const{return img_.Height();};
-	unsigned GetImageBytesPerPixel() const{return img_.Depth();};
+	unsigned GetImageWidth() const{return imageWidth_;};
+	unsigned GetImageHeight() const{return imageHeight_;};
+	unsigned GetImageBytesPerPixel() const{return byteDepth_;};
 	unsigned GetBitDepth() const{return bitDepth_;};
-	long GetImageBufferSize() const{return img_.Width() * img_.Height() * GetImageBytesPerPixel();}
+	long GetImageBufferSize() const{return imageWidth_ * imageHeight_ * GetImageBytesPerPixel();}
 	int GetComponentName(unsigned comp, char* name);
 	unsigned GetNumberOfComponents() const{return numComponents_;};
 	double GetExposure() const;
@@ -82,24 +104,49 @@ public:
 	int StartSequenceAcquisition(double interval);
 	int StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow);
 	int StopSequenceAcquisition();
-	int InsertImage();
+	int InsertImage(const KsFrame* frame, const unsigned char* pixels);
 	int ThreadRun();
+	int InsertRun();
 	bool IsCapturing();
 	void OnThreadExiting() throw();
 	int GetBinning() const;
 	int SetBinning(int bS);
 
-	int IsExposureSequenceable(bool& isSequenceable) const
-	{
-		isSequenceable = false;
-		return DEVICE_OK;
-	}
+	int IsExposureSequenceable(bool& isSequenceable) const;
+	int GetExposureSequenceMaxLength(long& nrEvents) const;
+	int StartExposureSequence();
+	int StopExposureSequence();
+	int ClearExposureSequence();
+	int AddToExposureSequence(double exposureTime_ms);
+	int SendExposureSequence() const;
 
 
 	// action interface
 	// ----------------
 	int OnCameraSelection(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnBinningMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnOutputMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnConvertThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnQueueDepth(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnQueueLevel(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnQueuePeak(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnGrabStageBusy(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnInsertStageBusy(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameDropless(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStatsCounter(MM::PropertyBase* pProp, MM::ActionType eAct, long data);
+	int OnStatsLatency(MM::PropertyBase* pProp, MM::ActionType eAct, long data);
+	int OnStatsFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStatsInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnBufferMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnBufferCount(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnBuffersAllocated(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnWarmSnap(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSequenceTrigger(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSnapLatency(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFeatureBatch(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnBatchCommitTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnImageFormat(MM::PropertyBase*, MM::ActionType);
 	int OnExposureTime(MM::PropertyBase*, MM::ActionType);
 	int OnHardwareGain(MM::PropertyBase*, MM::ActionType);
@@ -139,16 +186,39 @@ public:
 private:
 	int CreateKsProperty(lx_uint32 FeatureId, CPropertyAction* pAct);
 	void SearchDevices();
-	void Bgr8ToBGRA8(unsigned char* dest, unsigned char* src, lx_uint32 width, lx_uint32 height);
-	void GrabFrame();
-	void SetFeature(lx_uint32 uiFeatureId);
+	lx_result GrabFrame(KsFrame* frame, bool newest, lx_uint32& uiRemained, bool mayBeEmpty);
+	const unsigned char* DirectPixels(const KsFrame* frame) const;
+	void ReleaseSnapFrame();
+	void ConvertFrame(unsigned char* dest, const unsigned char* src);
+	void FinishPipeline(bool discard);
+	void CountFrameGap(lx_ushort16 frameNo);
+	void RestartStatsMonitor();
+	void HandleEventRecord(const KsEventRecord& record);
+	lx_result SetFeature(lx_uint32 uiFeatureId);
+	void BeginFeatureBatch();
+	lx_result CommitFeatureBatch();
+	void ResyncFeatures(const lx_uint32* featureIds, size_t count);
+	void UpdateFeatureProperties(lx_uint32 featureId);
+	int UploadExposureSequence();
 	void GetAllFeaturesDesc();
+	CAM_FeatureDesc* LoadFeatureDesc(lx_uint32 uiFeatureId);
+	bool IsFeatureDescLoaded(lx_uint32 uiFeatureId);
+	void InvalidateFeatureDesc(lx_uint32 uiFeatureId);
+	void EndDescPrefetch(bool updateProperties);
+	void OpenDescCache();
+	void FinishDescCache();
 	void GetAllFeatures();
 	void UpdateImageSettings();
 	void SetROILimits();
+	int ApplyROI(KsFormat& format, const CAM_Position& position);
+	void MarkFeatureChanged(lx_uint32 featureId);
+	void UpdateDerivedState(unsigned effects);
+	double FrameIntervalMs();
 	void SetMeteringAreaLimits();
-	void Command(const lx_wchar* wszCommand);
-	const char* ConvFeatureIdToName(const lx_uint32 uiFeatureId);
+	lx_result Command(const lx_wchar* wszCommand);
+	lx_result StartFrameTransfer(double intervalMs);
+	lx_uint32 AutoBufferCount(double intervalMs);
+	void DisarmWarmSnap();
 
 	//  Device Info ----------------------------------------
 	BOOL isOpened_;
@@ -157,7 +227,7 @@ private:
 	lx_uint32 deviceIndex_;
 	lx_uint32 deviceCount_;
 	CAM_Device device_;
-	CAM_Image image_;
+	FramePool framePool_;
 
 	//  Camera ---------------------------------------------
 	lx_uint32 cameraHandle_;
@@ -171,7 +241,27 @@ private:
 	Vector_CAM_FeatureValue vectFeatureValue_;
 	CAM_FeatureDesc* featureDesc_;
 	//CAM_FeatureDescFormat m_stDescFormat;
-	std::map<lx_uint32, lx_uint32> mapFeatureIndex_;
+	FeatureIndex featureIndex_;
+	MMThreadLock descLock_;					// featureDesc_ fetches, shared with prefetchThd_
+	std::vector<bool> descLoaded_;			// per feature index
+	std::vector<bool> descStale_;			// changed on the camera since the cache was written
+	std::vector<bool> descDeferred_;		// invalidated while prefetchThd_ was still loading
+	bool descPrefetching_;					// prefetchThd_ may write into featureDesc_
+	double descFetchMs_;
+	lx_uint32 descFetched_;
+	lx_uint32 descCached_;
+	DescCache descCache_;
+	DescCacheKey descCacheKey_;
+	std::string descCachePath_;
+	bool descCacheHit_;
+	FormatTable formats_;
+	volatile bool formatsStale_;			// eFormat descriptor changed, rebuild formats_ on next use
+	KsFormat format_;						// active format, copied out of formats_
+	volatile LONG staleEffects_;			// EFeatureEffect bits waiting for UpdateDerivedState()
+	FeatureLabelCache featureLabels_;
+	bool featureBatch_;							// SetFeature only records the id while set
+	std::vector<lx_uint32> batchFeatureIds_;	// pending ids, values are read from vectFeatureValue_ on commit
+	double batchCommitMs_;
 
 	inline void Free_Vector_CAM_FeatureValue(Vector_CAM_FeatureValue& vectFeatureValue)
 	{
@@ -183,7 +273,7 @@ private:
 	}
 	
 	//Image info
-	ImgBuffer img_;
+	TripleBuffer<ImgBuffer> frames_;		// converted frames, written by snap or (while it runs) the insert stage, read by GetImageBuffer()
 	long imageWidth_;
 	long imageHeight_;
 	int bitDepth_;
@@ -196,20 +286,83 @@ private:
 	bool stopOnOverFlow_;
 	MM::MMTime readoutStartTime_;
 	MM::MMTime sequenceStartTime_;
-	unsigned roiX_;
+	unsigned roiX_;							// ROI offset inside the driver frame, cropped in ConvertFrame()
 	unsigned roiY_;
 	unsigned roiWidth_;
 	unsigned roiHeight_;
+	bool roiActive_;						// SetROI() crop in effect
+	CAM_Format roiFormat_;					// format SetROI() chose, any other format clears the ROI
 	long imageCounter_;
-	long binSize_;
+	long binSize_;							// hardware times software binning
+	unsigned swBin_;						// software binning in ConvertFrame(), 1 for none
+	bool binMean_;							// software binning averages instead of summing
+	EOutputMode outputMode_;				// what color formats are converted to
+	KsFrame* snapFrame_;					// last snap, converted on the first GetImageBuffer()
 	double readoutUs_;
 	volatile double framesPerSecond_;
 
-	MMThreadLock imgPixelsLock_;
 	friend class MySequenceThread;
+	friend class MyInsertThread;
+	friend class MyEventThread;
+	friend class MyPrefetchThread;
 	MySequenceThread* thd_;
+	MyInsertThread* insertThd_;
+	MyEventThread* eventThd_;
+	MyPrefetchThread* prefetchThd_;
 	char* cameraBuf_; // camera buffer for image transfer
 	int cameraBufId_; // buffer id, required by the SDK
+
+	//  Conversion kernels ---------------------------------
+	ECpuSimdLevel simdLevel_;
+	StripeWorkerPool convertPool_;
+	unsigned convertThreads_;
+
+	//  Sequence pipeline ----------------------------------
+	SpscQueue<KsFrame*> frameQueue_;
+	MMEvent insertEvent_;		// a frame was queued for the insert stage
+	MMEvent queueSpaceEvent_;	// the insert stage released a frame
+	unsigned queueDepth_;
+	volatile unsigned queuePeak_;
+	volatile double grabBusyUs_;
+	volatile double insertBusyUs_;
+
+	//  Frame accounting -----------------------------------
+	bool frameDropless_;
+	volatile lx_uint32 framesRemained_;	// frames still buffered in the driver after the last grab
+	lx_ushort16 lastFrameNo_;
+
+	//  Statistics -----------------------------------------
+	AcqStats stats_;
+	StatsMonitorThread* statsMonitor_;
+	std::string statsFile_;
+	long statsIntervalMs_;
+	/* Arrival time per frame number (low bits of the callback uiFrameNo, which match the footer usFrameNo) */
+	volatile lx_int64 receivedTicks_[KSCAM_RECEIVED_TICKS];
+	volatile LONGLONG signalTick_;			// oldest frame signal the grab stage has not consumed, 0 if none
+
+	//  Callback events ------------------------------------
+	SpscQueue<KsEventRecord> eventRing_;	// callback thread -> eventThd_
+
+	//  Driver buffers -------------------------------------
+	bool bufferAuto_;
+	lx_uint32 bufferCount_;
+	lx_uint32 buffersAllocated_;
+
+	//  Warm snap ------------------------------------------
+	bool warmSnap_;
+	bool transferArmed_;	// frame transfer left running between snaps
+	double snapLatencyMs_;
+
+	//  Soft burst sequence --------------------------------
+	bool softBurst_;
+	lx_uint32 burstRemaining_;	// frames of the current burst not collected yet
+
+	//  Exposure sequence ----------------------------------
+	bool exposureSequenceable_;
+	volatile bool exposureSequenceRunning_;
+	lx_uint32 exposureModeBeforeSequence_;
+	lx_uint32 exposureSequenceMaxUs_;
+	std::vector<lx_uint32> exposureSequence_;	// usec
 };
 
 class MySequenceThread : public MMDeviceThreadBase
@@ -277,6 +430,71 @@ private:
 	NikonKsCam* camera_;
 };
 
+class MyInsertThread : public MMDeviceThreadBase
+{
+	friend class NikonKsCam;
+
+public:
+	MyInsertThread(NikonKsCam* pCam);
+	~MyInsertThread();
+	void Start();
+	void Finish(bool discard);
+
+	bool IsRunning() const
+	{
+		return running_;
+	}
+
+	bool IsDiscarding() const
+	{
+		return discard_;
+	}
+
+private:
+	int svc(void) throw();
+	volatile bool running_;
+	volatile bool finish_;
+	volatile bool discard_;
+	NikonKsCam* camera_;
+};
+
+/* Logs and counts callback events away from the SDK callback thread */
+class MyEventThread : public MMDeviceThreadBase
+{
+	friend class NikonKsCam;
+
+public:
+	MyEventThread(NikonKsCam* pCam);
+	~MyEventThread();
+	void Start();
+	void Stop();
+
+private:
+	int svc(void) throw();
+	bool running_;
+	volatile bool quit_;
+	MMEvent wake_;
+	NikonKsCam* camera_;
+};
+
+/* Fetches the remaining feature descriptors in the background after Initialize */
+class MyPrefetchThread : public MMDeviceThreadBase
+{
+	friend class NikonKsCam;
+
+public:
+	MyPrefetchThread(NikonKsCam* pCam);
+	~MyPrefetchThread();
+	void Start();
+	void Stop();
+
+private:
+	int svc(void) throw();
+	bool running_;
+	volatile bool quit_;
+	NikonKsCam* camera_;
+};
+
 
 #endif //_NIKONKS_H_
 
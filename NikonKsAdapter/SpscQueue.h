@@ -0,0 +1,97 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SpscQueue.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Bounded lock-free single producer / single consumer queue
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_SPSCQUEUE_H_
+#define _NIKONKS_SPSCQUEUE_H_
+
+#ifdef WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#endif
+
+/* Exactly one thread may call Push() and exactly one other thread may call Pop().
+   head_ and tail_ are free running counters, each written by one side only and
+   published with an interlocked exchange so the slot contents are visible first. */
+template <class T>
+class SpscQueue
+{
+public:
+	SpscQueue() : buffer_(NULL), mask_(0), depth_(0), head_(0), tail_(0) {}
+	~SpscQueue() {delete [] buffer_;}
+
+	/* Not thread safe, only call while neither side is running. Drops anything queued. */
+	void Reset(unsigned depth)
+	{
+		unsigned size = 1;
+		while (size < depth)
+			size <<= 1;
+		if (size != mask_ + 1 || buffer_ == NULL)
+		{
+			delete [] buffer_;
+			buffer_ = new T[size];
+			mask_ = size - 1;
+		}
+		depth_ = depth;
+		head_ = 0;
+		tail_ = 0;
+	}
+
+	/* Producer side, returns false when the queue already holds depth items */
+	bool Push(const T& item)
+	{
+		unsigned long tail = (unsigned long)tail_;
+		if (tail - (unsigned long)head_ >= depth_)
+			return false;
+		buffer_[tail & mask_] = item;
+		InterlockedExchange(&tail_, (LONG)(tail + 1));
+		return true;
+	}
+
+	/* Consumer side, returns false when the queue is empty */
+	bool Pop(T& item)
+	{
+		unsigned long head = (unsigned long)head_;
+		if ((unsigned long)tail_ == head)
+			return false;
+		item = buffer_[head & mask_];
+		InterlockedExchange(&head_, (LONG)(head + 1));
+		return true;
+	}
+
+	/* Approximate when called while either side is running */
+	unsigned Size() const {return (unsigned)((unsigned long)tail_ - (unsigned long)head_);}
+	unsigned Depth() const {return depth_;}
+
+private:
+	SpscQueue(const SpscQueue&);
+	SpscQueue& operator=(const SpscQueue&);
+
+	T* buffer_;
+	unsigned long mask_;
+	unsigned depth_;
+	/* Keep the consumer and producer counters on separate cache lines */
+	char pad0_[64];
+	volatile LONG head_;
+	char pad1_[64];
+	volatile LONG tail_;
+	char pad2_[64];
+};
+
+#endif //_NIKONKS_SPSCQUEUE_H_
@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TripleBuffer.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free triple buffer handing the latest frame from one
+//                writer to one reader
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_TRIPLEBUFFER_H_
+#define _NIKONKS_TRIPLEBUFFER_H_
+
+#ifdef WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#endif
+
+/* Exactly one thread may call Write()/Publish() and exactly one other thread may call Read().
+   The writer and reader each own one slot, the third is the ready slot they swap theirs with
+   in a single interlocked exchange, so neither side ever waits and a slot is never shared.
+   The writer role may move to another thread only while the old writer is stopped, with
+   something in between that orders memory (a thread start or join), never concurrently. */
+template <class T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() : write_(0), read_(2), ready_(1) {}
+
+	/* Not thread safe, for resizing the slots while neither side is running */
+	T& Slot(unsigned index) {return slots_[index];}
+
+	/* Writer side: the slot to fill, owned by the writer until Publish() */
+	T& Write() {return slots_[write_];}
+	/* Writer side: makes Write() the newest frame and takes over the slot it replaces */
+	void Publish()
+	{
+		write_ = InterlockedExchange(&ready_, write_ | TRIPLEBUFFER_FRESH) & TRIPLEBUFFER_INDEX;
+	}
+
+	/* Reader side: the newest published slot, or the one returned last time when nothing new
+	   was published. Stays untouched by the writer until the next Read(). */
+	T& Read()
+	{
+		if ((ready_ & TRIPLEBUFFER_FRESH) != 0)
+			read_ = InterlockedExchange(&ready_, read_) & TRIPLEBUFFER_INDEX;
+		return slots_[read_];
+	}
+
+private:
+	enum
+	{
+		TRIPLEBUFFER_INDEX	= 0x3,
+		TRIPLEBUFFER_FRESH	= 0x4,	// ready_ holds a slot the reader has not seen
+	};
+
+	TripleBuffer(const TripleBuffer&);
+	TripleBuffer& operator=(const TripleBuffer&);
+
+	T slots_[3];
+	/* Keep the writer, reader and shared indices on separate cache lines */
+	char pad0_[64];
+	LONG write_;
+	char pad1_[64];
+	LONG read_;
+	char pad2_[64];
+	volatile LONG ready_;
+	char pad3_[64];
+};
+
+#endif //_NIKONKS_TRIPLEBUFFER_H_
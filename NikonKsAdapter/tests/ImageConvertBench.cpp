@@ -0,0 +1,169 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ImageConvertBench.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Throughput of every conversion and binning kernel at every
+//                SIMD level this CPU runs, at every camera format resolution
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "ImageConvert.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/* Image sizes of the ECamFormatMode values in KsCamFeature.h, the ones FormatTable builds formats from */
+struct FrameMode
+{
+    const char* name;
+    unsigned width;
+    unsigned height;
+};
+
+static const FrameMode g_FrameModes[] =
+{
+    {"Full-16M",        4908,   3264},
+    {"ROI",             2454,   1632},
+    {"1/3 Average",     1636,   1088},
+    {"1/3 Average ROI", 818,    544},
+    {"Full",            1608,   1608},
+    {"ROI",             804,    804},
+    {"1/3 Average",     536,    536},
+};
+
+typedef std::chrono::steady_clock BenchClock;
+
+/* Best of repeats, so a page fault or another process on the first pass does not count */
+template <class F>
+static double BestSeconds(F run, int repeats)
+{
+    double best = 1e30;
+    for (int i = 0; i < repeats; i++)
+    {
+        BenchClock::time_point start = BenchClock::now();
+        run();
+        double s = std::chrono::duration<double>(BenchClock::now() - start).count();
+        if (s < best)
+            best = s;
+    }
+    return best;
+}
+
+/* GB/s counts the bytes read plus the bytes written */
+static void Report(const char* name, ECpuSimdLevel level, size_t pixels, size_t bytes, double seconds)
+{
+    printf("%-16s %-7s %8.2f ms %8.0f MP/s %7.2f GB/s\n", name, GetCpuSimdLevelName(level),
+           seconds * 1e3, pixels / seconds / 1e6, bytes / seconds / 1e9);
+}
+
+struct ConvertBench
+{
+    const char* name;
+    ConvertFunc (*select)(ECpuSimdLevel level);
+    unsigned destBytes;
+};
+
+struct BinBench
+{
+    const char* name;
+    BinFunc (*select)(ECpuSimdLevel level);
+    unsigned bytesPerPixel;
+};
+
+/* Every kernel at every level up to cpuLevel on one mode sized frame */
+static void RunMode(const ConvertBench* converts, size_t convertCount, const BinBench* bins, size_t binCount,
+                    const FrameMode& mode, ECpuSimdLevel cpuLevel, int repeats,
+                    const std::vector<unsigned char>& src, std::vector<unsigned char>& dest)
+{
+    const size_t pixels = (size_t)mode.width * mode.height;
+
+    for (size_t k = 0; k < convertCount; k++)
+    {
+        ConvertFunc previous = NULL;
+        for (int level = ecslScalar; level <= cpuLevel; level++)
+        {
+            ConvertFunc convert = converts[k].select((ECpuSimdLevel)level);
+            /* A kernel without a version for this level falls back to the one below */
+            if (convert == previous)
+                continue;
+            previous = convert;
+            double s = BestSeconds([&]() {convert(&dest[0], &src[0], pixels);}, repeats);
+            Report(converts[k].name, (ECpuSimdLevel)level, pixels, pixels * (3 + converts[k].destBytes), s);
+        }
+    }
+
+    for (size_t k = 0; k < binCount; k++)
+    {
+        for (unsigned factor = 2; factor <= 4; factor += 2)
+        {
+            BinFunc previous = NULL;
+            for (int level = ecslScalar; level <= cpuLevel; level++)
+            {
+                BinFunc bin = bins[k].select((ECpuSimdLevel)level);
+                if (bin == previous)
+                    continue;
+                previous = bin;
+                size_t srcRowBytes = (size_t)mode.width * bins[k].bytesPerPixel;
+                size_t destWidth = mode.width / factor;
+                size_t destHeight = mode.height / factor;
+                size_t destRowBytes = destWidth * bins[k].bytesPerPixel;
+                double s = BestSeconds([&]() {
+                    for (size_t row = 0; row < destHeight; row++)
+                        bin(&dest[row * destRowBytes], &src[row * factor * srcRowBytes], srcRowBytes, destWidth, factor, true);
+                }, repeats);
+                char name[32];
+                sprintf(name, "%s %ux%u", bins[k].name, factor, factor);
+                Report(name, (ECpuSimdLevel)level, pixels, pixels * bins[k].bytesPerPixel + destHeight * destRowBytes, s);
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    static const ConvertBench converts[] =
+    {
+        {"Bgr8ToBGRA8",     SelectBgr8ToBGRA8,      4},
+        {"Yuv444ToBGRA8",   SelectYuv444ToBGRA8,    4},
+        {"Bgr8ToLuma16",    SelectBgr8ToLuma16,     2},
+        {"Bgr8ToGreen8",    SelectBgr8ToGreen8,     1},
+        {"Yuv444ToLuma16",  SelectYuv444ToLuma16,   2},
+        {"Yuv444ToGreen8",  SelectYuv444ToGreen8,   1},
+    };
+    static const BinBench bins[] =
+    {
+        {"BinMono16",   SelectBinMono16,    2},
+        {"BinMono8",    SelectBinMono8,     1},
+        {"BinBGRA8",    SelectBinBGRA8,     4},
+    };
+    int repeats = argc > 1 ? atoi(argv[1]) : 10;
+    ECpuSimdLevel cpuLevel = GetCpuSimdLevel();
+    /* Sized for the largest mode, the smaller ones use the start of the buffers */
+    std::vector<unsigned char> src((size_t)g_FrameModes[0].width * g_FrameModes[0].height * 4);
+    std::vector<unsigned char> dest(src.size());
+
+    for (size_t i = 0; i < src.size(); i++)
+        src[i] = (unsigned char)(i * 2654435761u >> 24);
+    printf("Best of %d, CPU SIMD level %s\n", repeats, GetCpuSimdLevelName(cpuLevel));
+
+    for (size_t m = 0; m < sizeof(g_FrameModes) / sizeof(g_FrameModes[0]); m++)
+    {
+        printf("\n%ux%u %s\n", g_FrameModes[m].width, g_FrameModes[m].height, g_FrameModes[m].name);
+        RunMode(converts, sizeof(converts) / sizeof(converts[0]), bins, sizeof(bins) / sizeof(bins[0]),
+                g_FrameModes[m], cpuLevel, repeats, src, dest);
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ImageConvertTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Checks that every SIMD conversion and binning kernel writes
+//                exactly what its scalar version writes, tails included
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "ImageConvert.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+/* Bytes past the end of every destination that no kernel may touch */
+#define GUARD_BYTES     64
+#define GUARD_VALUE     0xCD
+
+struct ConvertKernel
+{
+    const char* name;
+    ECpuSimdLevel level;
+    ConvertFunc scalar;
+    ConvertFunc simd;
+    unsigned srcBytes;
+    unsigned destBytes;
+};
+
+struct BinKernel
+{
+    const char* name;
+    BinFunc scalar;
+    BinFunc simd;
+    unsigned bytesPerPixel;
+};
+
+static const ConvertKernel g_ConvertKernels[] =
+{
+    {"Bgr8ToBGRA8",     ecslSSSE3,  Bgr8ToBGRA8_Scalar,     Bgr8ToBGRA8_SSSE3,      3, 4},
+#ifdef NIKONKS_HAVE_AVX2
+    {"Bgr8ToBGRA8",     ecslAVX2,   Bgr8ToBGRA8_Scalar,     Bgr8ToBGRA8_AVX2,       3, 4},
+#endif
+    {"Yuv444ToBGRA8",   ecslSSSE3,  Yuv444ToBGRA8_Scalar,   Yuv444ToBGRA8_SSSE3,    3, 4},
+    {"Bgr8ToLuma16",    ecslSSSE3,  Bgr8ToLuma16_Scalar,    Bgr8ToLuma16_SSSE3,     3, 2},
+    {"Bgr8ToGreen8",    ecslSSSE3,  Bgr8ToGreen8_Scalar,    Bgr8ToGreen8_SSSE3,     3, 1},
+    {"Yuv444ToLuma16",  ecslSSSE3,  Yuv444ToLuma16_Scalar,  Yuv444ToLuma16_SSSE3,   3, 2},
+    {"Yuv444ToGreen8",  ecslSSSE3,  Yuv444ToGreen8_Scalar,  Yuv444ToGreen8_SSSE3,   3, 1},
+};
+
+static const BinKernel g_BinKernels[] =
+{
+    {"BinMono16",   BinMono16_Scalar,   BinMono16_SSSE3,    2},
+    {"BinMono8",    BinMono8_Scalar,    BinMono8_SSSE3,     1},
+    {"BinBGRA8",    BinBGRA8_Scalar,    BinBGRA8_SSSE3,     4},
+};
+
+/* Deterministic so a failure can be reproduced */
+static unsigned g_Seed = 12345;
+static unsigned char RandomByte()
+{
+    g_Seed = g_Seed * 1103515245 + 12345;
+    return (unsigned char)(g_Seed >> 16);
+}
+
+static void FillRandom(std::vector<unsigned char>& buffer)
+{
+    for (size_t i = 0; i < buffer.size(); i++)
+        buffer[i] = RandomByte();
+}
+
+static int g_Failures = 0;
+
+static void Fail(const char* kernel, ECpuSimdLevel level, const char* what, size_t count, size_t offset)
+{
+    if (g_Failures++ < 20)
+        printf("FAIL %s %s: %s, %u pixels, offset %u\n", kernel, GetCpuSimdLevelName(level), what, (unsigned)count, (unsigned)offset);
+}
+
+/* Compares the two kernels on pixelCount pixels. The source ends exactly at the end of its
+   buffer, so a read past the last pixel shows up under a memory checker, and both destinations
+   start offset bytes into theirs to leave them unaligned. */
+static void CompareConvert(const ConvertKernel& kernel, size_t pixelCount, size_t offset)
+{
+    std::vector<unsigned char> src(pixelCount * kernel.srcBytes + offset);
+    FillRandom(src);
+    const unsigned char* s = src.empty() ? NULL : &src[0] + offset;
+
+    size_t destSize = offset + pixelCount * kernel.destBytes + GUARD_BYTES;
+    std::vector<unsigned char> expected(destSize, GUARD_VALUE);
+    std::vector<unsigned char> actual(destSize, GUARD_VALUE);
+
+    kernel.scalar(&expected[offset], s, pixelCount);
+    kernel.simd(&actual[offset], s, pixelCount);
+
+    if (memcmp(&expected[offset], &actual[offset], pixelCount * kernel.destBytes) != 0)
+        Fail(kernel.name, kernel.level, "pixels differ from scalar", pixelCount, offset);
+    for (size_t i = 0; i < destSize; i++)
+    {
+        if ((i < offset || i >= offset + pixelCount * kernel.destBytes) && actual[i] != GUARD_VALUE)
+        {
+            Fail(kernel.name, kernel.level, "wrote outside the destination", pixelCount, offset);
+            break;
+        }
+    }
+}
+
+static void TestConvertKernels(ECpuSimdLevel cpuLevel)
+{
+    /* Every tail length of the 16 and 32 pixel loops, then a few odd frame sized counts */
+    static const size_t large[] = {1023, 4097, 100003, 1636 * 3 + 1};
+
+    for (size_t k = 0; k < sizeof(g_ConvertKernels) / sizeof(g_ConvertKernels[0]); k++)
+    {
+        const ConvertKernel& kernel = g_ConvertKernels[k];
+        if (kernel.level > cpuLevel)
+        {
+            printf("skip %s %s, not supported by this CPU\n", kernel.name, GetCpuSimdLevelName(kernel.level));
+            continue;
+        }
+        for (size_t count = 0; count <= 96; count++)
+        {
+            for (size_t offset = 0; offset < 4; offset++)
+                CompareConvert(kernel, count, offset);
+        }
+        for (size_t i = 0; i < sizeof(large) / sizeof(large[0]); i++)
+            CompareConvert(kernel, large[i], 1);
+    }
+}
+
+/* Every Y, Cb, Cr combination, one Y value at a time */
+static void TestYuv444Exhaustive(ECpuSimdLevel cpuLevel)
+{
+    static const struct {const char* name; ConvertFunc scalar; ConvertFunc simd; unsigned destBytes;} kernels[] =
+    {
+        {"Yuv444ToBGRA8",   Yuv444ToBGRA8_Scalar,   Yuv444ToBGRA8_SSSE3,    4},
+        {"Yuv444ToLuma16",  Yuv444ToLuma16_Scalar,  Yuv444ToLuma16_SSSE3,   2},
+        {"Yuv444ToGreen8",  Yuv444ToGreen8_Scalar,  Yuv444ToGreen8_SSSE3,   1},
+    };
+    const size_t pixelCount = 256 * 256;
+    std::vector<unsigned char> src(pixelCount * 3);
+    std::vector<unsigned char> expected(pixelCount * 4);
+    std::vector<unsigned char> actual(pixelCount * 4);
+
+    if (cpuLevel < ecslSSSE3)
+        return;
+    for (unsigned y = 0; y < 256; y++)
+    {
+        for (size_t i = 0; i < pixelCount; i++)
+        {
+            src[i * 3] = (unsigned char)y;
+            src[i * 3 + 1] = (unsigned char)(i >> 8);
+            src[i * 3 + 2] = (unsigned char)i;
+        }
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+        {
+            kernels[k].scalar(&expected[0], &src[0], pixelCount);
+            kernels[k].simd(&actual[0], &src[0], pixelCount);
+            if (memcmp(&expected[0], &actual[0], pixelCount * kernels[k].destBytes) != 0)
+                Fail(kernels[k].name, ecslSSSE3, "differs from scalar for some Cb, Cr at this Y", pixelCount, y);
+        }
+    }
+}
+
+/* One output row from factor source rows, the last source row ending at the end of the buffer */
+static void CompareBin(const BinKernel& kernel, size_t destPixels, unsigned factor, bool mean)
+{
+    size_t srcRowBytes = destPixels * factor * kernel.bytesPerPixel + 3 * kernel.bytesPerPixel;
+    std::vector<unsigned char> src(srcRowBytes * factor);
+    FillRandom(src);
+    /* Saturated values catch overflow in the SIMD sums */
+    for (size_t i = 0; i < src.size(); i += 7)
+        src[i] = 0xFF;
+
+    size_t destSize = destPixels * kernel.bytesPerPixel + GUARD_BYTES;
+    std::vector<unsigned char> expected(destSize, GUARD_VALUE);
+    std::vector<unsigned char> actual(destSize, GUARD_VALUE);
+
+    kernel.scalar(&expected[0], &src[0], srcRowBytes, destPixels, factor, mean);
+    kernel.simd(&actual[0], &src[0], srcRowBytes, destPixels, factor, mean);
+
+    if (expected != actual)
+        Fail(kernel.name, ecslSSSE3, mean ? "mean differs from scalar" : "sum differs from scalar", destPixels, factor);
+}
+
+static void TestBinKernels(ECpuSimdLevel cpuLevel)
+{
+    if (cpuLevel < ecslSSSE3)
+        return;
+    for (size_t k = 0; k < sizeof(g_BinKernels) / sizeof(g_BinKernels[0]); k++)
+    {
+        for (unsigned factor = 1; factor <= 4; factor++)
+        {
+            for (int mean = 0; mean < 2; mean++)
+            {
+                for (size_t destPixels = 0; destPixels <= 40; destPixels++)
+                    CompareBin(g_BinKernels[k], destPixels, factor, mean != 0);
+                CompareBin(g_BinKernels[k], 4908 / factor, factor, mean != 0);
+            }
+        }
+    }
+}
+
+/* The Select functions must never hand out a kernel above the level asked for */
+static void TestSelect()
+{
+    if (SelectBgr8ToBGRA8(ecslScalar) != Bgr8ToBGRA8_Scalar ||
+        SelectYuv444ToBGRA8(ecslScalar) != Yuv444ToBGRA8_Scalar ||
+        SelectBgr8ToLuma16(ecslScalar) != Bgr8ToLuma16_Scalar ||
+        SelectBgr8ToGreen8(ecslScalar) != Bgr8ToGreen8_Scalar ||
+        SelectYuv444ToLuma16(ecslScalar) != Yuv444ToLuma16_Scalar ||
+        SelectYuv444ToGreen8(ecslScalar) != Yuv444ToGreen8_Scalar ||
+        SelectBinMono16(ecslScalar) != BinMono16_Scalar ||
+        SelectBinMono8(ecslScalar) != BinMono8_Scalar ||
+        SelectBinBGRA8(ecslScalar) != BinBGRA8_Scalar)
+        Fail("Select", ecslScalar, "returned a SIMD kernel", 0, 0);
+    if (SelectBgr8ToBGRA8(ecslSSSE3) != Bgr8ToBGRA8_SSSE3)
+        Fail("SelectBgr8ToBGRA8", ecslSSSE3, "returned another kernel", 0, 0);
+}
+
+int main()
+{
+    ECpuSimdLevel cpuLevel = GetCpuSimdLevel();
+    printf("CPU SIMD level: %s\n", GetCpuSimdLevelName(cpuLevel));
+
+    TestSelect();
+    TestConvertKernels(cpuLevel);
+    TestYuv444Exhaustive(cpuLevel);
+    TestBinKernels(cpuLevel);
+
+    if (g_Failures != 0)
+    {
+        printf("%d failures\n", g_Failures);
+        return 1;
+    }
+    printf("All kernels match scalar\n");
+    return 0;
+}
@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TripleBufferTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   One writer publishing numbered frames as fast as it can while
+//                one reader checks it never sees a torn or an older frame
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "Interlocked.h"
+#include "TripleBuffer.h"
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#define FRAME_COUNT     1000000
+#define FRAME_WORDS     1024
+
+/* Every word of a frame holds its number, a torn frame mixes two numbers */
+struct Frame
+{
+    Frame() : words(FRAME_WORDS, 0) {}
+    std::vector<unsigned> words;
+};
+
+int main()
+{
+    TripleBuffer<Frame> frames;
+    volatile LONG done = 0;
+    unsigned long reads = 0, torn = 0, backwards = 0;
+    unsigned last = 0;
+
+    std::thread writer([&]() {
+        for (unsigned n = 1; n <= FRAME_COUNT; n++)
+        {
+            Frame& frame = frames.Write();
+            for (size_t i = 0; i < FRAME_WORDS; i++)
+                frame.words[i] = n;
+            frames.Publish();
+        }
+        InterlockedExchange(&done, 1);
+    });
+
+    for (;;)
+    {
+        bool finished = done != 0;
+        const Frame& frame = frames.Read();
+        unsigned n = frame.words[0];
+        for (size_t i = 1; i < FRAME_WORDS; i++)
+        {
+            if (frame.words[i] != n)
+            {
+                torn++;
+                break;
+            }
+        }
+        if (n < last)
+            backwards++;
+        last = n;
+        reads++;
+        /* The read after the writer finished must return its last frame */
+        if (finished)
+            break;
+    }
+    writer.join();
+
+    printf("%lu reads, %lu torn, %lu older than the previous read, last frame %u of %u\n",
+           reads, torn, backwards, last, FRAME_COUNT);
+    return (torn == 0 && backwards == 0 && last == FRAME_COUNT) ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Interlocked.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   The Win32 interlocked functions TripleBuffer.h uses, for
+//                building its test with gcc or clang
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_COMPAT_INTERLOCKED_H_
+#define _NIKONKS_COMPAT_INTERLOCKED_H_
+
+#ifdef WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+typedef long LONG;
+
+/* Full barrier like the Win32 version */
+static inline LONG InterlockedExchange(volatile LONG* target, LONG value)
+{
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+#endif
+
+#endif //_NIKONKS_COMPAT_INTERLOCKED_H_
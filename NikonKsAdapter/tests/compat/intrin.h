@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          intrin.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   The MSVC CPU identification intrinsics ImageConvert.cpp uses,
+//                for building the kernel tests with gcc or clang
+//
+// AUTHOR:        Andrew Gomella, andrewgomella@gmail.com, 2015
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _NIKONKS_COMPAT_INTRIN_H_
+#define _NIKONKS_COMPAT_INTRIN_H_
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* Newer cpuid.h headers declare a __cpuidex of their own and all of them have a __cpuid macro
+   with the registers as separate arguments, so both names are mapped onto local versions */
+static inline void NikonKsCpuidex(int info[4], int leaf, int subleaf)
+{
+	__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+}
+
+#undef __cpuid
+#undef __cpuidex
+#define __cpuid(info, leaf)				NikonKsCpuidex(info, leaf, 0)
+#define __cpuidex(info, leaf, subleaf)	NikonKsCpuidex(info, leaf, subleaf)
+
+/* The compiler's _xgetbv is only usable in functions built for XSAVE, the instruction itself
+   is safe once CPUID reported OSXSAVE, which is checked first */
+static inline unsigned long long NikonKsXgetbv(unsigned int index)
+{
+	unsigned int eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return ((unsigned long long)edx << 32) | eax;
+}
+
+#undef _xgetbv
+#define _xgetbv(index)					NikonKsXgetbv(index)
+
+#endif //_NIKONKS_COMPAT_INTRIN_H_